@@ -21,9 +21,8 @@ public:
 
     Vector3f SamplePoint() const
     {
-        auto random_u = get_random_float();
-        auto random_v = get_random_float();
-        return position + random_u * u + random_v * v;
+        Vector2f random = get_random_float2();
+        return position + random.x * u + random.y * v;
     }
 
     float length;
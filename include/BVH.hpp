@@ -9,6 +9,7 @@
 #include <vector>
 #include <memory>
 #include <ctime>
+#include <string>
 #include "Object.hpp"
 #include "Ray.hpp"
 #include "Bounds3.hpp"
@@ -18,6 +19,11 @@
 struct BVHBuildNode;
 // BVHAccel Forward Declarations
 struct BVHPrimitiveInfo;
+struct LinearBVHNode;
+struct TrianglePack;
+struct WideBVHNode;
+struct TraversalHit;
+struct ObjectSplit;
 
 // BVHAccel Declarations
 inline int leafNodes, totalLeafNodes, totalPrimitives, interiorNodes;
@@ -25,27 +31,124 @@ class BVHAccel {
 
 public:
     // BVHAccel Public Types
-    enum class SplitMethod { NAIVE, SAH };
+    // NAIVE splits at the centroid median, SAH bins centroids and minimizes
+    // the surface area cost, HLBVH sorts primitives along a Morton curve and
+    // only runs SAH over the top levels, trading tree quality for build time,
+    // SBVH adds SAH spatial splits that clip primitives into both children
+    enum class SplitMethod { NAIVE, SAH, HLBVH, SBVH };
+    // BVH2 traverses the binary tree, BVH4 a 4-ary collapse of it whose
+    // child boxes are tested together
+    enum class Accelerator { BVH2, BVH4 };
+    // accelerator picked by newly built trees
+    static inline Accelerator defaultAccelerator = Accelerator::BVH2;
+    // builder used for the scene and mesh BVHs
+    static inline SplitMethod defaultSplitMethod = SplitMethod::SAH;
+    // nodes with at least this many primitives build their halves in parallel
+    static inline int parallelBuildThreshold = 4096;
+    // extra references an SBVH build may create, relative to the primitive count
+    static inline float spatialSplitBudget = .3f;
+    // ReportCost also builds a median split tree to compare against; never
+    // for trees loaded from a cache, whose point is to skip building
+    static inline bool compareWithMedian = false;
 
     // BVHAccel Public Methods
-    BVHAccel(std::vector<Object*> p, int maxPrimsInNode = 1, SplitMethod splitMethod = SplitMethod::NAIVE);
+    // nBuckets: number of centroid bins tested per SAH split
+    // traversalCost: cost of visiting a node relative to one primitive test,
+    //                a leaf is kept whenever its cost is below the best split
+    // leaves of triangle meshes are tested four triangles at a time, so up to
+    // four primitives per node cost about as much as one
+    BVHAccel(std::vector<Object*> p, int maxPrimsInNode = 1, SplitMethod splitMethod = SplitMethod::NAIVE,
+             int nBuckets = 12, float traversalCost = .125f);
     Bounds3 WorldBound() const;
     ~BVHAccel();
 
     Intersection Intersect(const Ray &ray) const;
-    Intersection getIntersection(BVHBuildNode* node, const Ray& ray)const;
     bool IntersectP(const Ray &ray) const;
-    BVHBuildNode* root;
+    // switch traversal between the binary tree and its 4-ary collapse
+    void SetAccelerator(Accelerator accel);
+
+    // expected cost of a random ray against this tree, in primitive tests
+    float SAHCost() const;
+    // recompute bounds and areas bottom-up after primitives moved, keeping
+    // the topology; traversal gets slower as the boxes stop fitting the motion
+    void Refit();
+    // SAH cost now relative to right after the build, 1 for a fresh tree
+    float RefitQuality() const;
+    // a refit tree this much worse than a fresh build is worth rebuilding
+    bool NeedsRebuild(float maxQuality = 1.5f) const { return RefitQuality() > maxQuality; }
+    // print node count, build time and SAH cost, next to that of a median
+    // split tree if compareWithMedian is set
+    void ReportCost(const std::string &name) const;
+
+    // key for a cached tree, changes with anything that changes the build
+    static uint64_t SettingsHash(int maxPrimsInNode, SplitMethod splitMethod, int nBuckets = 12,
+                                 float traversalCost = .125f);
+    // flat copy of the tree with primitives stored as indices into prims,
+    // the array the tree was built from
+    std::vector<char> Serialize(const std::vector<Object*> &prims) const;
+    // the tree Serialize wrote over the same prims, nullptr if data does not
+    // hold a valid one
+    static BVHAccel* FromCache(const char* data, size_t size, const std::vector<Object*> &prims,
+                               int maxPrimsInNode, SplitMethod splitMethod, int nBuckets = 12,
+                               float traversalCost = .125f);
 
     // BVHAccel Private Methods
-    BVHBuildNode* recursiveBuild(std::vector<Object*>objects);
+    ObjectSplit findObjectSplit(const BVHPrimitiveInfo* refs, int count, const Bounds3 &bounds,
+                                const Bounds3 &centroidBounds) const;
+    BVHBuildNode* recursiveBuild(std::vector<BVHPrimitiveInfo> &primitiveInfo, int start, int end, int depth,
+                                 std::atomic<int> &totalNodes);
+    BVHBuildNode* spatialBuild(std::vector<BVHPrimitiveInfo> &refs, int depth, float rootArea,
+                               std::vector<BVHPrimitiveInfo> &orderedRefs, int &refBudget,
+                               std::atomic<int> &totalNodes);
+    BVHBuildNode* HLBVHBuild(std::vector<BVHPrimitiveInfo> &primitiveInfo, std::atomic<int> &totalNodes);
+    BVHBuildNode* emitLBVH(std::vector<BVHPrimitiveInfo> &primitiveInfo, const std::vector<uint32_t> &codes,
+                           int start, int end, int bitIndex, std::atomic<int> &totalNodes);
+    BVHBuildNode* buildUpperSAH(std::vector<BVHBuildNode*> &treelets, int start, int end, int depth, int reserve,
+                                std::atomic<int> &totalNodes);
+    int flattenBVHTree(BVHBuildNode* node, int &offset, int depth = 0);
+    void packLeafTriangles();
+    void fillPacks();
+    int collapseToWide(int binaryIndex);
+    void intersectLeaf(int offset, int count, const Ray& ray, TraversalHit &hit) const;
+    bool occludedLeaf(int offset, int count, const Ray& ray) const;
+    Intersection IntersectWide(const Ray &ray) const;
+    bool IntersectWideP(const Ray &ray) const;
+    // area a primitive reference adds for sampling, spatial-split copies and
+    // padding add none so every primitive is counted once
+    float refArea(int i) const
+    {
+        return duplicateRef.empty() ? primitives[i]->getArea() : duplicateRef[i] ? 0.f : primitives[i]->getArea();
+    }
+    // cost of testing a leaf of n primitives, four packed triangles count as one test
+    float primCost(int n) const { return packTriangles ? (n + 3) / 4 : n; }
 
     // BVHAccel Private Data
     const int maxPrimsInNode;
     const SplitMethod splitMethod;
+    const int nBuckets;
+    const float traversalCost;
+    // with SBVH a primitive can be referenced by several leaves; closest-hit
+    // traversal keeps the nearest t so a second test of the same triangle
+    // changes nothing, and only the first reference counts for sampling
     std::vector<Object*> primitives;
-
-    void getSample(BVHBuildNode* node, float p, Intersection &pos, float &pdf);
+    std::vector<bool> duplicateRef;
+    // depth-first node array, the first child of an interior node follows it
+    std::vector<LinearBVHNode> nodes;
+    // summed primitive area per node, only read when sampling
+    std::vector<float> nodeArea;
+    // set when every primitive is a triangle: leaves then start on a multiple
+    // of four in primitives (padded with nullptr) and packs[offset / 4] holds
+    // their triangles in SoA form
+    bool packTriangles = false;
+    std::vector<TrianglePack> packs;
+    // filled when traversing as BVH4, root at index 0
+    std::vector<WideBVHNode> wideNodes;
+    int totalNodes = 0;
+    double buildMilliseconds = 0.;
+    bool loadedFromCache = false;
+    float builtSAHCost = 0.f;
+
+    void getSample(int nodeIndex, float p, Intersection &pos, float &pdf);
     void Sample(Intersection &pos, float &pdf);
 };
 
@@ -53,7 +156,6 @@ struct BVHBuildNode {
     Bounds3 bounds;
     BVHBuildNode *left;
     BVHBuildNode *right;
-    Object* object;
     float area;
 
 public:
@@ -63,9 +165,42 @@ public:
         bounds = Bounds3();
         left = nullptr;
         right = nullptr;
-        object = nullptr;
     }
+    ~BVHBuildNode(){
+        delete left;
+        delete right;
+    }
+};
+
+struct alignas(32) LinearBVHNode {
+    Bounds3 bounds;
+    union {
+        int primitivesOffset;   // leaf
+        int secondChildOffset;  // interior
+    };
+    uint16_t nPrimitives;  // 0 -> interior node
+    uint8_t axis;          // interior node: xyz
+    uint8_t pad[1];        // ensure 32 byte total size
+};
+static_assert(sizeof(LinearBVHNode) == 32, "LinearBVHNode should fill half a cache line");
+
+// four triangles as v0 and the two edges, one lane per triangle; unused
+// lanes have zero edges and never report a hit
+struct alignas(16) TrianglePack {
+    float v0[3][4];
+    float e1[3][4];
+    float e2[3][4];
+};
+
+// four children with their boxes stored per axis, so one SIMD slab test
+// covers all of them; 128 bytes, two cache lines
+struct alignas(16) WideBVHNode {
+    float bounds[2][3][4];  // [min / max][axis][child]
+    int child[4];           // wide node index, or first primitive of a leaf child
+    int nPrimitives[4];     // > 0: leaf child, 0: interior child, -1: empty slot
+    void setChildBounds(int i, const Bounds3 &b);
 };
+static_assert(sizeof(WideBVHNode) == 128, "WideBVHNode should fill two cache lines");
 
 
 
@@ -45,7 +45,7 @@ class Bounds3
         return 2.f * (d.x * d.y + d.x * d.z + d.y * d.z);
     }
 
-    Vector3f Centroid() { return 0.5f * pMin + 0.5f * pMax; }
+    Vector3f Centroid() const { return 0.5f * pMin + 0.5f * pMax; }
     Bounds3 Intersect(const Bounds3& b)
     {
         return Bounds3(Vector3f(fmax(pMin.x, b.pMin.x), fmax(pMin.y, b.pMin.y),
@@ -86,12 +86,24 @@ class Bounds3
 
     inline bool IntersectP(const Ray& ray, const Vector3f& invDir,
                            const std::array<int, 3>& dirisNeg) const;
+    // also reject boxes entered beyond tMax, tEnter returns the entry distance
+    inline bool IntersectP(const Ray& ray, const Vector3f& invDir,
+                           const std::array<int, 3>& dirisNeg,
+                           float tMax, float& tEnter) const;
 };
 
 
 
 inline bool Bounds3::IntersectP(const Ray& ray, const Vector3f& invDir,
                                 const std::array<int, 3>& dirIsNeg) const
+{
+    float tEnter;
+    return IntersectP(ray, invDir, dirIsNeg, kInfinity, tEnter);
+}
+
+inline bool Bounds3::IntersectP(const Ray& ray, const Vector3f& invDir,
+                                const std::array<int, 3>& dirIsNeg,
+                                float tMax, float& tEnter) const
 {
     // invDir: ray direction(x,y,z), invDir=(1.0/x,1.0/y,1.0/z), use this because Multiply is faster that Division
     // dirIsNeg: ray direction(x,y,z), dirIsNeg=[int(x>0),int(y>0),int(z>0)], use this to simplify your logic
@@ -116,7 +128,8 @@ inline bool Bounds3::IntersectP(const Ray& ray, const Vector3f& invDir,
     min_ts = (f_min - ray.origin) * invDir;
     float t_min = std::max(min_ts.x, std::max(min_ts.y, min_ts.z));
     float t_max = std::min(max_ts.x, std::min(max_ts.y, max_ts.z));
-    return (t_max >= t_min && t_max > 0);
+    tEnter = t_min;
+    return (t_max >= t_min && t_max > 0 && t_min <= tMax);
 }
 
 inline Bounds3 Union(const Bounds3& b1, const Bounds3& b2)
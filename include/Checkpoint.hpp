@@ -0,0 +1,41 @@
+//
+// Saved state of a progressive render, so a preempted job can resume.
+//
+
+#ifndef RAYTRACING_CHECKPOINT_H
+#define RAYTRACING_CHECKPOINT_H
+
+#include <string>
+#include "FrameBuffer.hpp"
+
+// what a checkpoint's samples were drawn with; resuming with anything else
+// would mix sample sets that do not belong together
+struct CheckpointSettings {
+    uint32_t samplerType;
+    uint32_t spp;
+    uint32_t seed;
+};
+
+// File layout: CheckpointHeader, then per pixel in row-major order the
+// accumulated radiance (three floats) and its PixelStats, so a checkpoint
+// does not depend on the tile size. Everything is host byte order.
+struct CheckpointHeader {
+    char magic[8];
+    uint32_t version;
+    int32_t width;
+    int32_t height;
+    CheckpointSettings settings;
+};
+
+enum class CheckpointStatus { Loaded, Missing, Mismatch };
+
+// written to a temporary file first so a crash never leaves half a checkpoint
+bool WriteCheckpoint(const std::string &path, const CheckpointSettings &settings,
+                     const TiledFrameBuffer &radiance, const TiledBuffer<PixelStats> &stats);
+// Missing if path does not exist or is damaged, Mismatch if it was written
+// for another image size or other settings; radiance and stats are only
+// filled when Loaded
+CheckpointStatus ReadCheckpoint(const std::string &path, const CheckpointSettings &settings,
+                                TiledFrameBuffer &radiance, TiledBuffer<PixelStats> &stats);
+
+#endif //RAYTRACING_CHECKPOINT_H
@@ -0,0 +1,35 @@
+//
+// Edge-aware denoising of a finished render, guided by first-hit features.
+//
+
+#ifndef RAYTRACING_DENOISER_H
+#define RAYTRACING_DENOISER_H
+
+#include <vector>
+#include "FrameBuffer.hpp"
+
+// A-trous wavelet filter after SVGF (Schied et al. 2017), without its
+// temporal part. The image is divided by the albedo so only lighting is
+// blurred, then filtered in passes of a 5x5 kernel whose taps spread twice
+// as far each pass. Taps are weighted down across normal and depth edges
+// and where their luminance differs by more than the pixel's noise, the
+// variance estimate being filtered along with the image.
+class Denoiser
+{
+public:
+    static inline int iterations = 5;
+    // luminance, normal and depth edge-stopping strengths
+    static inline float sigmaLuminance = 4.f;
+    static inline float sigmaNormal = 128.f;
+    static inline float sigmaDepth = 1.f;
+
+    // all buffers are row-major; variance is that of each pixel's mean
+    // luminance, negative where too few samples were taken to know it, such
+    // pixels use the spread of their neighbourhood instead
+    static std::vector<Vector3f> Filter(const std::vector<Vector3f> &image,
+                                        const std::vector<PixelFeatures> &features,
+                                        const std::vector<float> &variance,
+                                        int width, int height, int numThreads);
+};
+
+#endif //RAYTRACING_DENOISER_H
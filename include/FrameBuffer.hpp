@@ -0,0 +1,118 @@
+//
+// Accumulation buffers written by the multi-threaded renderer.
+//
+
+#ifndef RAYTRACING_FRAMEBUFFER_H
+#define RAYTRACING_FRAMEBUFFER_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+#include "Vector.hpp"
+
+// Pixels are stored tile by tile with the same tiling as TileScheduler. Every
+// tile starts on its own cache line, so the worker owning a tile can add to it
+// without locks and without sharing a line with the neighbouring tiles.
+// resolve() turns the tiles back into a row-major image.
+template <typename Pixel>
+class TiledBuffer
+{
+public:
+    TiledBuffer(int width, int height, int tileSize)
+        : width(width), height(height), tileSize(tileSize > 0 ? tileSize : 1)
+    {
+        tilesX = (width + this->tileSize - 1) / this->tileSize;
+        int tilesY = (height + this->tileSize - 1) / this->tileSize;
+        // round tiles up to whole cache lines, e.g. 16 pixels of 12 bytes
+        // span exactly three of them
+        size_t align = CacheLine / gcd(CacheLine, sizeof(Pixel));
+        tileStride = (this->tileSize * this->tileSize + align - 1) / align * align;
+        storage.resize(tileStride * tilesX * tilesY + align);
+        base = 0;
+        while (base < align && (reinterpret_cast<uintptr_t>(&storage[base]) & (CacheLine - 1)) != 0)
+            base++;
+    }
+
+    // only the worker rendering the tile that holds (x, y) may call this
+    Pixel& at(int x, int y)
+    {
+        int tx = x / tileSize, ty = y / tileSize;
+        int lx = x - tx * tileSize, ly = y - ty * tileSize;
+        return storage[base + (ty * tilesX + tx) * tileStride + ly * tileSize + lx];
+    }
+    const Pixel& at(int x, int y) const
+    {
+        return const_cast<TiledBuffer*>(this)->at(x, y);
+    }
+
+    // gather the tiles into a row-major image, every pixel multiplied by scale
+    std::vector<Pixel> resolve(float scale) const
+    {
+        std::vector<Pixel> image(width * height);
+        for (int y = 0; y < height; ++y)
+            for (int x = 0; x < width; ++x)
+                image[y * width + x] = at(x, y) * scale;
+        return image;
+    }
+
+    const int width, height, tileSize;
+
+private:
+    static constexpr size_t CacheLine = 64;
+    static constexpr size_t gcd(size_t a, size_t b) { return b ? gcd(b, a % b) : a; }
+    int tilesX;
+    size_t tileStride;
+    size_t base;
+    std::vector<Pixel> storage;
+};
+
+using TiledFrameBuffer = TiledBuffer<Vector3f>;
+
+inline float Luminance(const Vector3f &c)
+{
+    return 0.2126f * c.x + 0.7152f * c.y + 0.0722f * c.z;
+}
+
+// Running mean and variance of one pixel's sample luminance, updated with
+// Welford's method so a single pass over the samples stays stable.
+struct PixelStats
+{
+    float mean = 0;
+    float m2 = 0;
+    uint32_t n = 0;
+
+    void add(float x)
+    {
+        ++n;
+        float delta = x - mean;
+        mean += delta / n;
+        m2 += delta * (x - mean);
+    }
+
+    // standard error of the mean relative to the mean; pixels darker than
+    // minMean are measured against it instead, they barely show on screen
+    float relativeError(float minMean = 1e-2f) const
+    {
+        if (n < 2)
+            return INFINITY;
+        return std::sqrt(m2 / ((n - 1) * (float)n)) / std::max(mean, minMean);
+    }
+
+    // variance of the mean, -1 while there are too few samples to tell
+    float meanVariance() const
+    {
+        return n < 2 ? -1.f : m2 / ((n - 1) * (float)n);
+    }
+};
+
+// What a pixel's camera ray hit first, the auxiliary buffers guiding the
+// denoiser. depth is the hit distance, 0 where the ray left the scene.
+struct PixelFeatures
+{
+    Vector3f albedo;
+    Vector3f normal;
+    float depth = 0;
+};
+
+#endif //RAYTRACING_FRAMEBUFFER_H
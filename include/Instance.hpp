@@ -0,0 +1,95 @@
+//
+// A transformed reference to shared geometry.
+//
+
+#ifndef RAYTRACING_INSTANCE_H
+#define RAYTRACING_INSTANCE_H
+
+#include "Object.hpp"
+#include "Transform.hpp"
+
+// Places an object, typically a MeshTriangle with its own BVH, in the scene
+// without copying it: rays are taken into object space, hits come back to
+// world space. Many instances can share one object, the scene BVH is then
+// the top level over instance bounds and the object BVH the bottom level.
+class Instance : public Object
+{
+public:
+    // object is not owned, material replaces the object's own when set
+    Instance(Object* object, const Transform& toWorld, Material* material = nullptr)
+        : object(object), toWorld(toWorld), material(material),
+          bounds(toWorld(object->getBounds())), area(object->transformedArea(toWorld)) {}
+
+    void buildBVH() override { object->buildBVH(); }
+    // the scene refits the shared object first, the instance only follows it
+    void refitBVH() override
+    {
+        bounds = toWorld(object->getBounds());
+        area = object->transformedArea(toWorld);
+    }
+    void collectShared(std::vector<Object*> &shared) override { shared.push_back(object); }
+
+    // takes effect in the scene BVH on its next refitBVH
+    const Transform& transform() const { return toWorld; }
+    void setTransform(const Transform& t)
+    {
+        toWorld = t;
+        bounds = toWorld(object->getBounds());
+        area = object->transformedArea(toWorld);
+    }
+
+    bool intersect(const Ray& ray) override { return object->intersect(toWorld.ToLocal(ray)); }
+    bool intersect(const Ray&, float&, uint32_t&) const override { return false; }
+    Intersection getIntersection(Ray ray) override
+    {
+        Intersection isect = object->getIntersection(toWorld.ToLocal(ray));
+        if (!isect.happened)
+            return isect;
+        isect.coords = ray(isect.distance);
+        isect.normal = toWorld.Normal(isect.normal);
+        isect.obj = this;
+        if (material) {
+            isect.m = material;
+            isect.emit = material->getEmission();
+        }
+        return isect;
+    }
+    void getSurfaceProperties(const Vector3f& P, const Vector3f& I, const uint32_t& index,
+                              const Vector2f& uv, Vector3f& N, Vector2f& st) const override
+    {
+        object->getSurfaceProperties(P, I, index, uv, N, st);
+    }
+    Vector3f evalDiffuseColor(const Vector2f& st) const override { return object->evalDiffuseColor(st); }
+    Bounds3 getBounds() override { return bounds; }
+    float getArea() override { return area; }
+    // a non-uniform scale or shear stretches surfaces by different amounts
+    // depending on their orientation, so the object's density is converted
+    // with the area factor at the sampled point
+    void Sample(Intersection &pos, float &pdf) override
+    {
+        object->Sample(pos, pdf);
+        pdf /= toWorld.AreaScale(pos.normal);
+        pos.coords = toWorld.Point(pos.coords);
+        pos.normal = toWorld.Normal(pos.normal);
+        if (material)
+            pos.emit = material->getEmission();
+    }
+    float samplePdf(const Intersection &pos) override
+    {
+        Transform toLocal = toWorld.Inverse();
+        Intersection local = pos;
+        local.coords = toLocal.Point(pos.coords);
+        local.normal = toLocal.Normal(pos.normal);
+        return object->samplePdf(local) / toWorld.AreaScale(local.normal);
+    }
+    bool hasEmit() override { return material ? material->hasEmission() : object->hasEmit(); }
+
+private:
+    Object* object;
+    Transform toWorld;
+    Material* material;
+    Bounds3 bounds;
+    float area;
+};
+
+#endif //RAYTRACING_INSTANCE_H
@@ -0,0 +1,43 @@
+//
+// Read-only memory mapping of a whole file, and replacing a file atomically.
+//
+
+#ifndef RAYTRACING_MAPPEDFILE_H
+#define RAYTRACING_MAPPEDFILE_H
+
+#include <cstddef>
+#include <string>
+
+// Pages are loaded by the OS on first touch, so opening is cheap and the
+// contents can be hashed or copied without a read() into a buffer first.
+class MappedFile {
+public:
+    MappedFile() = default;
+    explicit MappedFile(const std::string &path) { open(path); }
+    ~MappedFile() { close(); }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    // false if the file is missing or cannot be mapped
+    bool open(const std::string &path);
+    void close();
+
+    bool isOpen() const { return opened; }
+    const char* data() const { return ptr; }
+    size_t size() const { return length; }
+
+private:
+    const char* ptr = nullptr;
+    size_t length = 0;
+    bool opened = false;
+#ifdef _WIN32
+    void* fileHandle = nullptr;
+    void* mapping = nullptr;
+#endif
+};
+
+// move from over to, replacing any existing file in one step so readers
+// see either the old or the new contents, never neither
+bool RenameReplacing(const std::string &from, const std::string &to);
+
+#endif //RAYTRACING_MAPPEDFILE_H
@@ -75,8 +75,8 @@ private:
     }
 
 public:
-    static Vector3f toWorld(const Vector3f &a, const Vector3f &N){
-        Vector3f B, C;
+    // orthonormal tangents B, C completing the normal N
+    static void tangents(const Vector3f &N, Vector3f &B, Vector3f &C){
         if (std::fabs(N.x) > std::fabs(N.y)){
             float invLen = 1.0f / std::sqrt(N.x * N.x + N.z * N.z);
             C = Vector3f(N.z * invLen, 0.0f, -N.x *invLen);
@@ -86,8 +86,17 @@ public:
             C = Vector3f(0.0f, N.z * invLen, -N.y *invLen);
         }
         B = crossProduct(C, N);
+    }
+    static Vector3f toWorld(const Vector3f &a, const Vector3f &N){
+        Vector3f B, C;
+        tangents(N, B, C);
         return a.x * B + a.y * C + a.z * N;
     }
+    static Vector3f toLocal(const Vector3f &a, const Vector3f &N){
+        Vector3f B, C;
+        tangents(N, B, C);
+        return Vector3f(dotProduct(a, B), dotProduct(a, C), dotProduct(a, N));
+    }
 
 public:
     MaterialType m_type;
@@ -107,12 +116,18 @@ public:
     inline Vector3f getEmission();
     inline bool hasEmission();
 
-    // sample a ray by Material properties
+    // The three agree on one estimator: sample() draws w_light for the view
+    // direction w_out (both pointing away from the surface), pdf() is its
+    // exact solid angle density and eval() the BSDF times cos(N, w_light),
+    // so eval / pdf is the path weight. MIRROR is a delta lobe: pdf is 1 and
+    // eval the weight of the one reflected direction.
     inline Vector3f sample(const Vector3f &w_out, const Vector3f &N);
-    // given a ray, calculate the PdF of this ray
     inline float pdf(const Vector3f &w_light, const Vector3f &w_out, const Vector3f &N);
-    // given a ray, calculate the contribution of this ray
-    inline Vector3f eval(const Vector3f &w_light, const Vector3f &w_out, const Vector3f &N, bool is_dir);
+    inline Vector3f eval(const Vector3f &w_light, const Vector3f &w_out, const Vector3f &N);
+    bool isDelta() const { return m_type == MIRROR; }
+    // GGX roughness alpha and the chance MICRO_FACET samples its specular lobe
+    float alpha() const { return roughness * roughness; }
+    inline float specularProbability(const Vector3f &w_out, const Vector3f &N) const;
 
 };
 
@@ -138,31 +153,88 @@ inline Vector3f FyReflect(const Vector3f& a, const Vector3f& n) {
     return 2.f * n * dotProduct(n, a) - a;
 }
 
+// cosine weighted direction on the hemisphere around N, pdf cos / PI
+inline Vector3f SampleCosineHemisphere(const Vector3f &N) {
+    Vector2f u = get_random_float2();
+    float r = std::sqrt(u.x), phi = 2 * M_PI * u.y;
+    Vector3f localRay(r * std::cos(phi), r * std::sin(phi), std::sqrt(std::max(0.f, 1.f - u.x)));
+    return Material::toWorld(localRay, N);
+}
+
+inline float GGX(float nh, float roughness) {
+    float alpha2 = roughness * roughness; alpha2 *= alpha2;
+    float tmp = nh * nh * (alpha2 - 1.f) + 1.f;
+    float denominator = M_PI * tmp * tmp;
+    return alpha2 / denominator;
+}
+
+// Smith masking of GGX for one direction, and height-correlated masking-shadowing
+inline float SmithG1(float nv, float alpha) {
+    float alpha2 = alpha * alpha;
+    return 2.f * nv / (nv + std::sqrt(alpha2 + (1.f - alpha2) * nv * nv));
+}
+inline float SmithG2(float nl, float nv, float alpha) {
+    float alpha2 = alpha * alpha;
+    return 2.f * nl * nv / (nv * std::sqrt(alpha2 + (1.f - alpha2) * nl * nl) +
+                            nl * std::sqrt(alpha2 + (1.f - alpha2) * nv * nv));
+}
+
+// GGX micro normal from the distribution of normals visible from local view
+// direction v (Heitz, "Sampling the GGX Distribution of Visible Normals")
+inline Vector3f SampleGGXVNDF(const Vector3f &v, float alpha, const Vector2f &u) {
+    Vector3f vh = normalize(Vector3f(alpha * v.x, alpha * v.y, v.z));
+    float lensq = vh.x * vh.x + vh.y * vh.y;
+    Vector3f t1 = lensq > 0 ? Vector3f(-vh.y, vh.x, 0) / std::sqrt(lensq) : Vector3f(1, 0, 0);
+    Vector3f t2 = crossProduct(vh, t1);
+    float r = std::sqrt(u.x), phi = 2 * M_PI * u.y;
+    float p1 = r * std::cos(phi), p2 = r * std::sin(phi);
+    float s = .5f * (1.f + vh.z);
+    p2 = (1.f - s) * std::sqrt(std::max(0.f, 1.f - p1 * p1)) + s * p2;
+    Vector3f nh = p1 * t1 + p2 * t2 + std::sqrt(std::max(0.f, 1.f - p1 * p1 - p2 * p2)) * vh;
+    return normalize(Vector3f(alpha * nh.x, alpha * nh.y, std::max(0.f, nh.z)));
+}
+
+inline Vector3f FyFresnel(const Vector3f& albedo, float hv, float metallic) {
+    float powed = std::pow(1.f-hv, 5.f);
+    Vector3f f0 = lerp(Vector3f(.04f), albedo, metallic);
+    Vector3f fresnel = f0 * (1.f - powed) + Vector3f(powed);
+    return fresnel;
+}
+inline Vector3f FyFresnelStrange(const Vector3f& albedo, float hv, float metallic) {
+    float powed = std::pow(1.f-hv, 5.f);
+    Vector3f x = albedo * Vector3f(1.f-powed);
+    Vector3f powv = Vector3f(powed);
+    Vector3f metal = x + powv;
+    Vector3f nonmetal = x * .04f + albedo * powv;
+    Vector3f fresnel = metal * metallic + nonmetal * (1.f - metallic);
+    return fresnel;
+}
+
+// the lobes' share of reflected energy, with the Fresnel term at the view angle
+float Material::specularProbability(const Vector3f &w_out, const Vector3f &N) const {
+    float nv = std::max(0.f, dotProduct(w_out, N));
+    Vector3f fresnel = FyFresnel(Kd, nv, metallic);
+    Vector3f diffuse = (Vector3f(1.f) - fresnel) * Kd * (1.f - metallic);
+    float specular = fresnel.x + fresnel.y + fresnel.z;
+    float total = specular + diffuse.x + diffuse.y + diffuse.z;
+    return total > 0 ? specular / total : 1.f;
+}
+
 Vector3f Material::sample(const Vector3f &w_out, const Vector3f &N) {
     switch(m_type){
         case DIFFUSE:
         {
-            // uniform sample on the hemisphere
-            float x_1 = get_random_float();
-            float x_2 = get_random_float();
-            float theta = std::acos(1.f - x_1);
-            float phi = 2 * M_PI * x_2;
-            float sin_theta = std::sin(theta);
-            Vector3f localRay(sin_theta*std::cos(phi), sin_theta*std::sin(phi), std::cos(theta));
-            return toWorld(localRay, N);
-            break;
+            return SampleCosineHemisphere(N);
         }
         case MICRO_FACET:
         {
-            float x_1 = get_random_float();
-            float x_2 = get_random_float();
-            float alpha2 = roughness * roughness; alpha2 *= alpha2;
-            float phi = 2.f * M_PI * x_1;
-            float cos_theta2 = (1.f - x_2) / ((alpha2 - 1.f)*x_2 + 1.f);
-            float cos_theta = std::sqrt(cos_theta2);
-            float sin_theta = std::sqrt(1.f-cos_theta2);
-            Vector3f micro_normal(sin_theta*std::cos(phi), sin_theta*std::sin(phi), cos_theta);
-            micro_normal = toWorld(micro_normal, N);
+            // pick a lobe, then sample it in proportion to what it reflects
+            if (get_random_float() >= specularProbability(w_out, N))
+                return SampleCosineHemisphere(N);
+            Vector3f v = toLocal(w_out, N);
+            if (v.z <= 0)
+                return -N;
+            Vector3f micro_normal = toWorld(SampleGGXVNDF(v, alpha(), get_random_float2()), N);
             return FyReflect(w_out, micro_normal);
         }
         case MIRROR:
@@ -177,16 +249,19 @@ float Material::pdf(const Vector3f &w_light, const Vector3f &w_out, const Vector
     switch(m_type){
         case DIFFUSE:
         {
-            // uniform sample probability 1 / (2 * PI)
-            if (dotProduct(w_out, N) > 0.0f)
-                return 0.5f / M_PI;
-            else
-                return 0.0f;
-            break;
+            return std::max(0.f, dotProduct(w_light, N)) / M_PI;
         }
         case MICRO_FACET:
         {
-            return 1.f;
+            float nl = dotProduct(w_light, N);
+            float nv = dotProduct(w_out, N);
+            if (nl <= 0 || nv <= 0)
+                return 0.0f;
+            // the visible normal density G1 D hv / nv, times the 1 / (4 hv) of reflecting
+            float nh = dotProduct(N, (w_light + w_out).normalized());
+            float specular = SmithG1(nv, alpha()) * GGX(nh, roughness) / (4.f * nv);
+            float p = specularProbability(w_out, N);
+            return p * specular + (1.f - p) * nl / M_PI;
         }
         case MIRROR:
         {
@@ -196,38 +271,7 @@ float Material::pdf(const Vector3f &w_light, const Vector3f &w_out, const Vector
     return 0.0f;
 }
 
-inline float GGX(float nh, float roughness) {
-    float alpha2 = roughness * roughness; alpha2 *= alpha2;
-    float tmp = nh * nh * (alpha2 - 1.f) + 1.f;
-    float denominator = M_PI * tmp * tmp;
-    return alpha2 / denominator;
-}
-
-inline float GeoOcc_(float nl, float nv, float roughness) {
-    float tmp = roughness + 1.f;
-    float k = tmp * tmp * .125f;
-    float denominator_v = nv * (1.f-k) + k;
-    float denominator_l = nl * (1.f-k) + k;
-    return 1.f / (denominator_l * denominator_v);
-}
-
-inline Vector3f FyFresnel(const Vector3f& albedo, float hv, float metallic) {
-    float powed = std::pow(1.f-hv, 5.f);
-    Vector3f f0 = lerp(Vector3f(.04f), albedo, metallic);
-    Vector3f fresnel = f0 * (1.f - powed) + Vector3f(powed);
-    return fresnel;
-}
-inline Vector3f FyFresnelStrange(const Vector3f& albedo, float hv, float metallic) {
-    float powed = std::pow(1.f-hv, 5.f);
-    Vector3f x = albedo * Vector3f(1.f-powed);
-    Vector3f powv = Vector3f(powed);
-    Vector3f metal = x + powv;
-    Vector3f nonmetal = x * .04f + albedo * powv;
-    Vector3f fresnel = metal * metallic + nonmetal * (1.f - metallic);
-    return fresnel;
-}
-
-Vector3f Material::eval(const Vector3f &w_light, const Vector3f &w_out, const Vector3f &N, bool is_dir){
+Vector3f Material::eval(const Vector3f &w_light, const Vector3f &w_out, const Vector3f &N){
     switch(m_type){
         case DIFFUSE:
         {
@@ -243,19 +287,18 @@ Vector3f Material::eval(const Vector3f &w_light, const Vector3f &w_out, const Ve
         }
         case MICRO_FACET:
         {
-            float nl = std::max(0.f, std::min(1.0f, dotProduct(w_light, N)));
+            float nl = dotProduct(w_light, N);
             float nv = dotProduct(w_out, N);
+            if (nl <= 0 || nv <= 0)
+                return Vector3f(0.0f);
             Vector3f h = (w_light + w_out).normalized();
             float nh = dotProduct(N, h);
             float hv = dotProduct(h, w_out);
-            float geo = GeoOcc_(nl, nv, roughness);
             Vector3f fresnel = FyFresnel(Kd, hv, metallic);
-            float ggx = GGX(nh, roughness);
-            float pdf = nh * .25f / nv * hv * ggx;
-            Vector3f diffuse = (Vector3f(1.f) - fresnel) * Kd * nl / M_PI * (1.f - metallic);
-            if (is_dir) {
-                return ggx * geo * fresnel * 0.25f + diffuse;
-            } else return fresnel * geo * hv * nv / nh + diffuse / pdf;
+            // D G F / (4 nl nv) and a Lambert lobe for what the coat lets through
+            Vector3f specular = fresnel * (GGX(nh, roughness) * SmithG2(nl, nv, alpha()) / (4.f * nl * nv));
+            Vector3f diffuse = (Vector3f(1.f) - fresnel) * Kd / M_PI * (1.f - metallic);
+            return (specular + diffuse) * nl;
         }
         case MIRROR:
         {
@@ -271,8 +314,8 @@ Vector3f Material::eval(const Vector3f &w_light, const Vector3f &w_out, const Ve
 namespace DiffOnly {
     
     inline Vector3f sample(const Vector3f &w_out, const Vector3f &N) {
-        float x_1 = get_random_float();
-        float x_2 = get_random_float();
+        Vector2f u = get_random_float2();
+        float x_1 = u.x, x_2 = u.y;
         float theta = std::acos(1.f - x_1);
         float phi = 2 * M_PI * x_2;
         float sin_theta = std::sin(theta);
@@ -0,0 +1,63 @@
+//
+// Binary cache of a mesh's vertex and index buffers and of the BVH built over them.
+//
+
+#ifndef RAYTRACING_MESHCACHE_H
+#define RAYTRACING_MESHCACHE_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "MappedFile.hpp"
+#include "Vector.hpp"
+
+// 64-bit FNV-1a, pass the previous result as hash to continue a sequence
+uint64_t HashBytes(const void* data, size_t size, uint64_t hash = 14695981039346656037ull);
+
+// File layout: MeshCacheHeader, three floats per vertex, two texture
+// coordinates per vertex if nTexcoords is set, three 32-bit vertex indices
+// per triangle, then the BVH blob written by BVHAccel::Serialize. The mesh is
+// valid while the source file hashes to contentHash; the BVH only for the
+// settings hashed into settingsHash. Everything is host byte order.
+struct MeshCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t contentHash;
+    uint64_t settingsHash;
+    uint64_t nVertices;
+    uint64_t nTexcoords;
+    uint64_t nTriangles;
+    uint64_t bvhBytes;
+};
+
+class MeshCache {
+public:
+    // map path and check it was written for a source with this content hash
+    bool open(const std::string &path, uint64_t contentHash);
+    void close();
+
+    size_t vertexCount() const { return header ? header->nVertices : 0; }
+    bool hasTexcoords() const { return header && header->nTexcoords; }
+    size_t triangleCount() const { return header ? header->nTriangles : 0; }
+    // copy the buffers out, the mapping is not necessarily aligned for them
+    void readVertices(Vector3f* vertices) const;
+    void readTexcoords(Vector2f* st) const;
+    void readIndices(uint32_t* indices) const;
+    // the BVH blob if it was built with these settings, nullptr otherwise
+    const char* bvhData(uint64_t settingsHash, size_t &size) const;
+
+    // written to a temporary file first so readers never see half a cache
+    // st may be nullptr for meshes without texture coordinates
+    static bool write(const std::string &path, uint64_t contentHash, uint64_t settingsHash,
+                      const Vector3f* vertices, const Vector2f* st, size_t nVertices,
+                      const uint32_t* indices, size_t nTriangles, const std::vector<char> &bvh);
+
+private:
+    const char* section(int i) const;
+
+    MappedFile file;
+    const MeshCacheHeader* header = nullptr;
+};
+
+#endif //RAYTRACING_MESHCACHE_H
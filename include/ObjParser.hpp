@@ -0,0 +1,35 @@
+//
+// Memory-mapped, multi-threaded Wavefront OBJ reader for triangle meshes.
+//
+
+#ifndef RAYTRACING_OBJPARSER_H
+#define RAYTRACING_OBJPARSER_H
+
+#include <string>
+#include <vector>
+#include "Vector.hpp"
+
+// Attributes in file order with one 0-based index per triangle corner into
+// each of them, -1 where a face does not reference that attribute. Polygons
+// are split into fans around their first corner.
+struct ObjMesh {
+    std::vector<Vector3f> positions;
+    std::vector<Vector2f> texcoords;
+    std::vector<Vector3f> normals;
+    std::vector<int> positionIndices;
+    std::vector<int> texcoordIndices;
+    std::vector<int> normalIndices;
+
+    size_t triangleCount() const { return positionIndices.size() / 3; }
+};
+
+// Reads v / vt / vn / f statements and skips everything else (groups,
+// materials, smoothing). The text is cut into line-aligned chunks parsed on
+// separate threads; negative (relative) indices are resolved afterwards.
+// Returns false with a message in error if a v / vt / vn line does not hold
+// finite numbers or an f line has a malformed corner, an index of 0 or fewer
+// than three corners, naming the line, or if a face refers to a missing
+// vertex.
+bool ParseObj(const char* data, size_t size, ObjMesh &mesh, std::string* error = nullptr);
+
+#endif //RAYTRACING_OBJPARSER_H
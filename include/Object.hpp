@@ -5,26 +5,57 @@
 #ifndef RAYTRACING_OBJECT_H
 #define RAYTRACING_OBJECT_H
 
+#include <vector>
 #include "Vector.hpp"
 #include "global.hpp"
 #include "Bounds3.hpp"
 #include "Ray.hpp"
 #include "Intersection.hpp"
+#include "Transform.hpp"
 
 class Object
 {
 public:
     Object() {}
     virtual ~Object() {}
+    // any-hit query for shadow rays, only hits closer than ray.t_max count
     virtual bool intersect(const Ray& ray) = 0;
     virtual bool intersect(const Ray& ray, float &, uint32_t &) const = 0;
     virtual Intersection getIntersection(Ray _ray) = 0;
+    // shading data for a hit another test already found at distance t with
+    // barycentrics (u, v), objects without such a test simply intersect again
+    virtual Intersection getIntersectionAt(const Ray& ray, float t, float u, float v)
+    {
+        return getIntersection(ray);
+    }
+    // triangles expose their corners so the BVH can pack them for SIMD tests
+    virtual bool getVertices(Vector3f&, Vector3f&, Vector3f&) const { return false; }
     virtual void getSurfaceProperties(const Vector3f &, const Vector3f &, const uint32_t &, const Vector2f &, Vector3f &, Vector2f &) const = 0;
     virtual Vector3f evalDiffuseColor(const Vector2f &) const =0;
     virtual Bounds3 getBounds()=0;
     virtual float getArea()=0;
+    // area once toWorld is applied; scaled by the average area factor unless
+    // the object can sum it exactly
+    virtual float transformedArea(const Transform &toWorld) { return getArea() * toWorld.AreaScale(); }
     virtual void Sample(Intersection &pos, float &pdf)=0;
+    // density per unit area of Sample() returning the point pos, so hits
+    // found by other strategies can be weighted against light sampling
+    virtual float samplePdf(const Intersection &pos) { return 1.f / getArea(); }
     virtual bool hasEmit()=0;
+    // build any acceleration structure over the object's own primitives, the
+    // scene calls this for all objects concurrently before building its own
+    virtual void buildBVH() {}
+    // bring that structure and the object's bounds up to date after its
+    // geometry moved, rebuilding only when refitting has degraded it too much
+    virtual void refitBVH() {}
+    // append the objects this one draws on without owning them, the scene
+    // refits each of those once before the objects that refer to them
+    virtual void collectShared(std::vector<Object*> &shared) {}
+    // append the emissive primitives light sampling should pick from
+    virtual void collectEmitters(std::vector<Object*> &emitters)
+    {
+        if (hasEmit()) emitters.push_back(this);
+    }
 };
 
 
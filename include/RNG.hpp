@@ -0,0 +1,74 @@
+//
+// PCG32 random number generator (M.E. O'Neill, pcg-random.org).
+//
+
+#ifndef RAYTRACING_RNG_H
+#define RAYTRACING_RNG_H
+
+#include <algorithm>
+#include <cstdint>
+
+// 64-bit finaliser from MurmurHash3, spreads nearby indices over the whole range
+inline uint64_t MixBits(uint64_t v)
+{
+    v ^= (v >> 31);
+    v *= 0x7fb5d329728ea185ULL;
+    v ^= (v >> 27);
+    v *= 0x81dadef4bc2dd44dULL;
+    v ^= (v >> 33);
+    return v;
+}
+
+// 16 bytes of state, every stream selected by SetSequence is independent and
+// Advance() jumps along a stream in O(log n)
+class RNG
+{
+public:
+    RNG() : state(0x853c49e6748fea9bULL), inc(0xda3e39cb94b95bdbULL) {}
+    RNG(uint64_t seqIndex, uint64_t seed) { SetSequence(seqIndex, seed); }
+
+    void SetSequence(uint64_t seqIndex, uint64_t seed)
+    {
+        state = 0u;
+        inc = (seqIndex << 1u) | 1u;
+        Uniform32();
+        state += seed;
+        Uniform32();
+    }
+    void SetSequence(uint64_t seqIndex) { SetSequence(seqIndex, MixBits(seqIndex)); }
+
+    uint32_t Uniform32()
+    {
+        uint64_t oldstate = state;
+        state = oldstate * 0x5851f42d4c957f2dULL + inc;
+        uint32_t xorshifted = (uint32_t)(((oldstate >> 18u) ^ oldstate) >> 27u);
+        uint32_t rot = (uint32_t)(oldstate >> 59u);
+        return (xorshifted >> rot) | (xorshifted << ((~rot + 1u) & 31));
+    }
+    // uniform in [0, 1)
+    float UniformFloat()
+    {
+        return std::min(0x1.fffffep-1f, Uniform32() * 0x1p-32f);
+    }
+
+    void Advance(int64_t idelta)
+    {
+        uint64_t curMult = 0x5851f42d4c957f2dULL, curPlus = inc, accMult = 1u;
+        uint64_t accPlus = 0u, delta = (uint64_t)idelta;
+        while (delta > 0) {
+            if (delta & 1) {
+                accMult *= curMult;
+                accPlus = accPlus * curMult + curPlus;
+            }
+            curPlus = (curMult + 1) * curPlus;
+            curMult *= curMult;
+            delta /= 2;
+        }
+        state = accMult * state + accPlus;
+    }
+
+private:
+    uint64_t state, inc;
+};
+
+#endif //RAYTRACING_RNG_H
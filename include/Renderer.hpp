@@ -12,11 +12,37 @@ struct hit_payload
     Object* hit_obj;
 };
 
+struct RenderOptions
+{
+    int spp = 8;
+    int numThreads = 0; // 0: one per hardware thread
+    int tileSize = 16;
+    // adaptive sampling: keep sampling a pixel while the relative standard
+    // error of its mean exceeds adaptiveError, spp becomes the cap; 0 is off
+    float adaptiveError = 0;
+    // samples every pixel takes first, and per pass after that
+    int minSpp = 16;
+    // progressive rendering: the accumulation buffer and sample counts are
+    // saved to checkpointPath every checkpointInterval seconds, at the end and
+    // on SIGINT / SIGTERM; with resume they are read back before rendering
+    std::string checkpointPath;
+    float checkpointInterval = 60;
+    bool resume = false;
+    // extra outputs next to the image: the first-hit albedo, normal and depth
+    // with each pixel's variance as PFM files, and a denoised copy
+    bool writeAovs = false;
+    bool denoise = false;
+    // selects another randomisation of the sampler's sequences
+    uint32_t seed = 0;
+};
+
 class Renderer
 {
 public:
     void Render(const Scene& scene, int rt_spp);
-    void RenderMultiThread(const Scene& scene, int rt_spp);
+    // false if nothing was rendered because a checkpoint to resume from was
+    // written with other settings
+    bool RenderMultiThread(const Scene& scene, const RenderOptions& options);
 
 private:
 };
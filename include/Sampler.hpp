@@ -0,0 +1,53 @@
+//
+// Per-pixel sample generators: independent, stratified and low-discrepancy.
+//
+
+#ifndef RAYTRACING_SAMPLER_H
+#define RAYTRACING_SAMPLER_H
+
+#include <cstdint>
+#include <memory>
+#include "RNG.hpp"
+#include "Vector.hpp"
+
+enum class SamplerType { Independent, Stratified, Hammersley, Sobol };
+
+// A sampler hands out the coordinates of one pixel sample dimension by
+// dimension: every Get1D / Get2D call moves on to the next dimension, so as
+// long as a path draws its numbers in the same order, each decision (light
+// choice, point on the light, BSDF direction, ...) of sample i sees the i-th
+// point of its own well distributed sequence. Dimensions are randomised per
+// pixel so neighbouring pixels do not share patterns.
+class Sampler
+{
+public:
+    // Stratified and Hammersley place samplesPerPixel points per dimension;
+    // sample indices past it start a new, independently randomised set, so
+    // drawing more samples than that stays unbiased.
+    static inline SamplerType defaultType = SamplerType::Independent;
+    static inline uint32_t samplesPerPixel = 1;
+    static std::unique_ptr<Sampler> Create(SamplerType type, uint32_t samplesPerPixel);
+
+    Sampler(SamplerType type, uint32_t samplesPerPixel) : type(type), spp(samplesPerPixel) {}
+    virtual ~Sampler() {}
+
+    // restart at dimension 0 of the given sample, seed selects another
+    // randomisation of the same sequence
+    virtual void StartPixelSample(uint32_t pixelIndex, uint32_t sampleIndex, uint32_t seed) = 0;
+    virtual float Get1D() = 0;
+    virtual Vector2f Get2D() = 0;
+
+    const SamplerType type;
+    const uint32_t spp;
+};
+
+// sampler of the calling thread, nothing is shared between render threads;
+// outside StartPixelSample it is an independent sampler
+Sampler& ThreadSampler();
+
+// Point the calling thread's sampler at one pixel sample, so the numbers
+// drawn for it do not depend on which thread renders it or in which order.
+// Picks up changes to Sampler::defaultType and samplesPerPixel.
+void StartPixelSample(uint32_t pixelIndex, uint32_t sampleIndex, uint32_t seed = 0);
+
+#endif //RAYTRACING_SAMPLER_H
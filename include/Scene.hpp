@@ -10,6 +10,7 @@
 #include "Light.hpp"
 #include "AreaLight.hpp"
 #include "BVH.hpp"
+#include "FrameBuffer.hpp"
 #include "Ray.hpp"
 
 
@@ -21,7 +22,10 @@ public:
     int height = 960;
     float fov = 40.f;
     Vector3f backgroundColor = Vector3f(0.235294f, 0.67451f, 0.843137f);
-    int maxDepth = 1;
+    // longest path in bounces, Russian roulette starts after russianRouletteDepth
+    // and never keeps a path with more than RussianRoulette probability
+    int maxDepth = 16;
+    int russianRouletteDepth = 3;
     float RussianRoulette = 0.95f;
 
     Scene(int w, int h) : width(w), height(h)
@@ -33,11 +37,26 @@ public:
     const std::vector<Object*>& get_objects() const { return objects; }
     const std::vector<std::unique_ptr<Light> >&  get_lights() const { return lights; }
     Intersection intersect(const Ray& ray) const;
+    // true if anything blocks the ray before ray.t_max
+    bool intersectP(const Ray& ray) const;
     BVHAccel *bvh;
+    // also builds the emitter table used by sampleLight
     void buildBVH();
+    // after objects moved or deformed: refit every BVH in place, rebuilding
+    // those that degraded too far, and refresh the emitter table
+    void refitBVH();
+    void buildEmitterTable();
     Vector3f castRay(const Ray &ray, int depth) const;
+    // the same path for a camera ray whose first hit is already known, so a
+    // pixel's samples can share one primary traversal
+    Vector3f castRay(const Ray &ray, const Intersection &primaryHit) const;
     Vector3f castRayDiff(const Ray &ray, int depth) const;
+    // albedo, normal and depth at the first bounce of a camera ray
+    PixelFeatures firstHitFeatures(const Intersection &primaryHit) const;
     void sampleLight(Intersection &pos, float &pdf) const;
+    // solid angle density, seen from point from, of sampleLight picking the
+    // emitter point lightHit
+    float lightPdf(const Intersection &lightHit, const Vector3f &from) const;
     bool trace(const Ray &ray, const std::vector<Object*> &objects, float &tNear, uint32_t &index, Object **hitObject);
     std::tuple<Vector3f, Vector3f> HandleAreaLight(const AreaLight &light, const Vector3f &hitPoint, const Vector3f &N,
                                                    const Vector3f &shadowPointOrig,
@@ -48,6 +67,13 @@ public:
     std::vector<Object* > objects;
     std::vector<std::unique_ptr<Light> > lights;
 
+    // emissive primitives with their running area sum, sampled by area
+    std::vector<Object*> emitters;
+    std::vector<float> emitterCdf;
+    float emitAreaSum = 0;
+
+    Vector3f tracePath(const Ray &ray, int depth, const Intersection *firstHit) const;
+
     // Compute reflection direction
     Vector3f reflect(const Vector3f &I, const Vector3f &N) const
     {
@@ -17,6 +17,7 @@ public:
     Material *m;
     float area;
     Sphere(const Vector3f &c, const float &r, Material* mt = new Material()) : center(c), radius(r), radius2(r * r), m(mt), area(4 * M_PI *r *r) {}
+    // occlusion test: same hits as getIntersection, limited to ray.t_max
     bool intersect(const Ray& ray) {
         // analytic solution
         Vector3f L = ray.origin - center;
@@ -24,11 +25,9 @@ public:
         float b = 2 * dotProduct(ray.direction, L);
         float c = dotProduct(L, L) - radius2;
         float t0, t1;
-        float area = 4 * M_PI * radius2;
         if (!solveQuadratic(a, b, c, t0, t1)) return false;
-        if (t0 < 0) t0 = t1;
-        if (t0 < 0) return false;
-        return true;
+        if (t0 < 1e-4) return false;
+        return t0 < ray.t_max;
     }
     bool intersect(const Ray& ray, float &tnear, uint32_t &index) const
     {
@@ -81,9 +80,12 @@ public:
                        Vector3f(center.x+radius, center.y+radius, center.z+radius));
     }
     void Sample(Intersection &pos, float &pdf){
-        float theta = 2.0f * M_PI * get_random_float();
-        float phi = M_PI * get_random_float();
-        Vector3f dir(std::cos(phi), std::sin(phi)*std::cos(theta), std::sin(phi)*std::sin(theta));
+        Vector2f u = get_random_float2();
+        // uniform in z and angle is uniform in area on a sphere
+        float z = 1.0f - 2.0f * u.x;
+        float r = std::sqrt(std::max(0.0f, 1.0f - z * z));
+        float phi = 2.0f * M_PI * u.y;
+        Vector3f dir(r * std::cos(phi), r * std::sin(phi), z);
         pos.coords = center + radius * dir;
         pos.normal = dir;
         pos.emit = m->getEmission();//pos.happened = true;
@@ -0,0 +1,42 @@
+//
+// Tile queues for the multi-threaded renderer.
+//
+
+#ifndef RAYTRACING_TILESCHEDULER_H
+#define RAYTRACING_TILESCHEDULER_H
+
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// pixel rectangle [x0, x1) x [y0, y1)
+struct Tile {
+    int x0, y0, x1, y1;
+};
+
+// Every worker owns a deque of tiles and pops from its front; once it runs
+// dry it steals from the back of the other workers' deques, so expensive
+// regions of the image no longer hold up a single thread.
+class TileScheduler {
+public:
+    TileScheduler(int width, int height, int tileSize, int numWorkers);
+
+    // next tile for worker, false once every queue is empty
+    bool next(int worker, Tile &tile);
+    int tileCount() const { return numTiles; }
+
+private:
+    struct alignas(64) WorkerQueue {
+        std::mutex mutex;
+        std::deque<Tile> tiles;
+    };
+    bool popFront(WorkerQueue &queue, Tile &tile);
+    bool popBack(WorkerQueue &queue, Tile &tile);
+
+    int numWorkers;
+    int numTiles;
+    std::unique_ptr<WorkerQueue[]> queues;
+};
+
+#endif //RAYTRACING_TILESCHEDULER_H
@@ -0,0 +1,148 @@
+//
+// Affine transforms for placing shared geometry in the scene.
+//
+
+#ifndef RAYTRACING_TRANSFORM_H
+#define RAYTRACING_TRANSFORM_H
+
+#include <cmath>
+#include "Bounds3.hpp"
+#include "Ray.hpp"
+#include "Vector.hpp"
+
+// 3x4 affine matrix, the implicit last row is (0, 0, 0, 1). The inverse is
+// kept next to it so rays can be taken into object space without solving
+// anything per ray.
+class Transform
+{
+public:
+    Transform() : m{{1, 0, 0, 0}, {0, 1, 0, 0}, {0, 0, 1, 0}},
+                  mInv{{1, 0, 0, 0}, {0, 1, 0, 0}, {0, 0, 1, 0}} {}
+
+    static Transform Translate(const Vector3f &delta)
+    {
+        Transform t;
+        for (int i = 0; i < 3; ++i) {
+            t.m[i][3] = delta[i];
+            t.mInv[i][3] = -delta[i];
+        }
+        return t;
+    }
+    static Transform Scale(const Vector3f &s)
+    {
+        Transform t;
+        for (int i = 0; i < 3; ++i) {
+            t.m[i][i] = s[i];
+            t.mInv[i][i] = 1.f / s[i];
+        }
+        return t;
+    }
+    // counter-clockwise rotation by theta radians about a unit axis
+    static Transform Rotate(float theta, const Vector3f &axis)
+    {
+        Vector3f a = normalize(axis);
+        float s = std::sin(theta), c = std::cos(theta);
+        Transform t;
+        t.m[0][0] = a.x * a.x + (1 - a.x * a.x) * c;
+        t.m[0][1] = a.x * a.y * (1 - c) - a.z * s;
+        t.m[0][2] = a.x * a.z * (1 - c) + a.y * s;
+        t.m[1][0] = a.x * a.y * (1 - c) + a.z * s;
+        t.m[1][1] = a.y * a.y + (1 - a.y * a.y) * c;
+        t.m[1][2] = a.y * a.z * (1 - c) - a.x * s;
+        t.m[2][0] = a.x * a.z * (1 - c) - a.y * s;
+        t.m[2][1] = a.y * a.z * (1 - c) + a.x * s;
+        t.m[2][2] = a.z * a.z + (1 - a.z * a.z) * c;
+        // rotations are orthonormal, the inverse is the transpose
+        for (int i = 0; i < 3; ++i)
+            for (int j = 0; j < 3; ++j)
+                t.mInv[i][j] = t.m[j][i];
+        return t;
+    }
+
+    // apply other first, then this
+    Transform operator*(const Transform &other) const
+    {
+        Transform t;
+        compose(m, other.m, t.m);
+        compose(other.mInv, mInv, t.mInv);
+        return t;
+    }
+    Transform Inverse() const
+    {
+        Transform t;
+        for (int i = 0; i < 3; ++i)
+            for (int j = 0; j < 4; ++j) {
+                t.m[i][j] = mInv[i][j];
+                t.mInv[i][j] = m[i][j];
+            }
+        return t;
+    }
+
+    Vector3f Point(const Vector3f &p) const { return apply(m, p, 1.f); }
+    Vector3f Vector(const Vector3f &v) const { return apply(m, v, 0.f); }
+    // normals go through the inverse transpose to stay perpendicular
+    Vector3f Normal(const Vector3f &n) const { return normalize(normalDirection(n)); }
+    // the direction is not renormalized, so ray parameters (and t_max) are
+    // the same on both sides of the transform
+    Ray ToLocal(const Ray &ray) const
+    {
+        Ray local(apply(mInv, ray.origin, 1.f), apply(mInv, ray.direction, 0.f), ray.t);
+        local.t_min = ray.t_min;
+        local.t_max = ray.t_max;
+        return local;
+    }
+    Bounds3 operator()(const Bounds3 &b) const
+    {
+        Bounds3 ret;
+        for (int i = 0; i < 8; ++i) {
+            Vector3f corner((i & 1) ? b.pMax.x : b.pMin.x,
+                            (i & 2) ? b.pMax.y : b.pMin.y,
+                            (i & 4) ? b.pMax.z : b.pMin.z);
+            ret = Union(ret, Point(corner));
+        }
+        return ret;
+    }
+    // factor by which areas of any orientation grow on average, exact only
+    // for rotations times a uniform scale
+    float AreaScale() const { return std::pow(std::fabs(determinant()), 2.f / 3.f); }
+    // factor by which the area of a surface element with the unit normal n
+    // in object space grows: |det| times the length of the inverse transpose
+    // applied to n, exact for any affine transform
+    float AreaScale(const Vector3f &n) const { return std::fabs(determinant()) * normalDirection(n).norm(); }
+
+private:
+    float determinant() const
+    {
+        return m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1]) -
+               m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0]) +
+               m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+    }
+    // inverse transpose times n, not normalized
+    Vector3f normalDirection(const Vector3f &n) const
+    {
+        return Vector3f(mInv[0][0] * n.x + mInv[1][0] * n.y + mInv[2][0] * n.z,
+                        mInv[0][1] * n.x + mInv[1][1] * n.y + mInv[2][1] * n.z,
+                        mInv[0][2] * n.x + mInv[1][2] * n.y + mInv[2][2] * n.z);
+    }
+    static Vector3f apply(const float a[3][4], const Vector3f &v, float w)
+    {
+        return Vector3f(a[0][0] * v.x + a[0][1] * v.y + a[0][2] * v.z + a[0][3] * w,
+                        a[1][0] * v.x + a[1][1] * v.y + a[1][2] * v.z + a[1][3] * w,
+                        a[2][0] * v.x + a[2][1] * v.y + a[2][2] * v.z + a[2][3] * w);
+    }
+    // out = a * b for affine matrices
+    static void compose(const float a[3][4], const float b[3][4], float out[3][4])
+    {
+        for (int i = 0; i < 3; ++i)
+            for (int j = 0; j < 4; ++j) {
+                out[i][j] = a[i][0] * b[0][j] + a[i][1] * b[1][j] + a[i][2] * b[2][j];
+                if (j == 3)
+                    out[i][j] += a[i][3];
+            }
+    }
+
+    float m[3][4];
+    float mInv[3][4];
+};
+
+#endif //RAYTRACING_TRANSFORM_H
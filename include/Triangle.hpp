@@ -3,11 +3,15 @@
 #include "BVH.hpp"
 #include "Intersection.hpp"
 #include "Material.hpp"
-#include "OBJ_Loader.hpp"
+#include "MeshCache.hpp"
+#include "ObjParser.hpp"
 #include "Object.hpp"
 #include "Triangle.hpp"
 #include <cassert>
+#include <cstring>
 #include <array>
+#include <mutex>
+#include <unordered_map>
 
 bool rayTriangleIntersect(const Vector3f& v0, const Vector3f& v1,
                           const Vector3f& v2, const Vector3f& orig,
@@ -39,103 +43,177 @@ bool rayTriangleIntersect(const Vector3f& v0, const Vector3f& v1,
     return true;
 }
 
+class MeshTriangle;
+
+// One face of a MeshTriangle. Only the mesh and the face index are stored,
+// corners come from the mesh's shared vertex and index buffers and the
+// normal and area are derived from them when a hit or sample needs them;
+// BVH leaves keep their own v0 / e1 / e2 copies packed for the SIMD test.
 class Triangle : public Object
 {
 public:
-    Vector3f v0, v1, v2; // vertices A, B ,C , counter-clockwise order
-    Vector3f e1, e2;     // 2 edges v1-v0, v2-v0;
-    Vector3f t0, t1, t2; // texture coords
-    Vector3f normal;
-    float area;
-    Material* m;
+    const MeshTriangle* mesh;
+    uint32_t index;
 
-    Triangle(Vector3f _v0, Vector3f _v1, Vector3f _v2, Material* _m = nullptr)
-        : v0(_v0), v1(_v1), v2(_v2), m(_m)
-    {
-        e1 = v1 - v0;
-        e2 = v2 - v0;
-        normal = normalize(crossProduct(e1, e2));
-        area = crossProduct(e1, e2).norm()*0.5f;
-    }
+    Triangle(const MeshTriangle* mesh, uint32_t index) : mesh(mesh), index(index) {}
 
     bool intersect(const Ray& ray) override;
     bool intersect(const Ray& ray, float& tnear,
                    uint32_t& index) const override;
     Intersection getIntersection(Ray ray) override;
+    Intersection getIntersectionAt(const Ray& ray, float t, float u, float v) override;
+    bool getVertices(Vector3f& a, Vector3f& b, Vector3f& c) const override;
+    Vector3f getNormal() const;
     void getSurfaceProperties(const Vector3f& P, const Vector3f& I,
                               const uint32_t& index, const Vector2f& uv,
-                              Vector3f& N, Vector2f& st) const override
-    {
-        N = normal;
-        //        throw std::runtime_error("triangle::getSurfaceProperties not
-        //        implemented.");
-    }
+                              Vector3f& N, Vector2f& st) const override;
     Vector3f evalDiffuseColor(const Vector2f&) const override;
     Bounds3 getBounds() override;
-    void Sample(Intersection &pos, float &pdf){
-        float x = std::sqrt(get_random_float()), y = get_random_float();
-        pos.coords = v0 * (1.0f - x) + v1 * (x * (1.0f - y)) + v2 * (x * y);
-        pos.normal = this->normal;// pos.happened = true;
-        pdf = 1.0f / area;
-    }
-    float getArea(){
-        return area;
-    }
-    bool hasEmit(){
-        return m->hasEmission();
-    }
+    void Sample(Intersection &pos, float &pdf) override;
+    float getArea() override;
+    bool hasEmit() override;
 };
 
 class MeshTriangle : public Object
 {
 public:
     MeshTriangle(const std::string& filename, Material *mt = new Material())
+        : filename(filename), cachePath(filename + ".bvhcache")
     {
-        objl::Loader loader;
-        loader.LoadFile(filename);
         area = 0;
         m = mt;
-        assert(loader.LoadedMeshes.size() == 1);
-        auto mesh = loader.LoadedMeshes[0];
-
-        Vector3f min_vert = Vector3f{std::numeric_limits<float>::infinity(),
-                                     std::numeric_limits<float>::infinity(),
-                                     std::numeric_limits<float>::infinity()};
-        Vector3f max_vert = Vector3f{-std::numeric_limits<float>::infinity(),
-                                     -std::numeric_limits<float>::infinity(),
-                                     -std::numeric_limits<float>::infinity()};
-        for (int i = 0; i < mesh.Vertices.size(); i += 3) {
-            std::array<Vector3f, 3> face_vertices;
-
-            for (int j = 0; j < 3; j++) {
-                auto vert = Vector3f(mesh.Vertices[i + j].Position.X,
-                                     mesh.Vertices[i + j].Position.Y,
-                                     mesh.Vertices[i + j].Position.Z);
-                face_vertices[j] = vert;
-
-                min_vert = Vector3f(std::min(min_vert.x, vert.x),
-                                    std::min(min_vert.y, vert.y),
-                                    std::min(min_vert.z, vert.z));
-                max_vert = Vector3f(std::max(max_vert.x, vert.x),
-                                    std::max(max_vert.y, vert.y),
-                                    std::max(max_vert.z, vert.z));
+        // the cache is keyed by the OBJ bytes, an edited model misses it
+        MappedFile obj(filename);
+        contentHash = HashBytes(obj.data(), obj.size());
+        if (useCache && cache.open(cachePath, contentHash)) {
+            numVertices = cache.vertexCount();
+            numTriangles = cache.triangleCount();
+            vertices.reset(new Vector3f[numVertices]);
+            vertexIndex.reset(new uint32_t[numTriangles * 3]);
+            cache.readVertices(vertices.get());
+            cache.readIndices(vertexIndex.get());
+            if (cache.hasTexcoords()) {
+                stCoordinates.reset(new Vector2f[numVertices]);
+                cache.readTexcoords(stCoordinates.get());
+            }
+        }
+        else {
+            ObjMesh mesh;
+            std::string error = "cannot open file";
+            if (!obj.isOpen() || !ParseObj(obj.data(), obj.size(), mesh, &error)) {
+                // stays empty, with neither a BVH nor a cache of the failure
+                printf(" - could not load %s: %s\n", filename.c_str(), error.c_str());
+                return;
             }
+            setBuffers(mesh);
+        }
+        obj.close();
+
+        triangles.reserve(numTriangles);
+        for (uint32_t i = 0; i < numTriangles; ++i)
+            triangles.emplace_back(this, i);
+        for (auto& tri : triangles) {
+            area += tri.getArea();
+            bounding_box = Union(bounding_box, tri.getBounds());
+        }
+    }
 
-            triangles.emplace_back(face_vertices[0], face_vertices[1],
-                                   face_vertices[2], mt);
+    // the triangles point back at the mesh
+    MeshTriangle(const MeshTriangle&) = delete;
+    MeshTriangle& operator=(const MeshTriangle&) = delete;
+
+    // one vertex per distinct OBJ position / texture coordinate pair, in the
+    // order faces first use them; positions no face uses are dropped
+    void setBuffers(const ObjMesh& mesh)
+    {
+        size_t nCorners = mesh.positionIndices.size();
+        std::unordered_map<uint64_t, uint32_t> remap;
+        std::vector<uint32_t> corners(nCorners);
+        numVertices = 0;
+        for (size_t i = 0; i < nCorners; ++i) {
+            uint64_t key = (uint64_t)mesh.positionIndices[i] << 32 | (uint32_t)(mesh.texcoordIndices[i] + 1);
+            auto it = remap.emplace(key, numVertices).first;
+            if (it->second == numVertices)
+                ++numVertices;
+            corners[i] = it->second;
         }
+        numTriangles = nCorners / 3;
+        vertices.reset(new Vector3f[numVertices]);
+        vertexIndex.reset(new uint32_t[nCorners]);
+        if (!mesh.texcoords.empty())
+            stCoordinates.reset(new Vector2f[numVertices]);
+        for (size_t i = 0; i < nCorners; ++i) {
+            vertexIndex[i] = corners[i];
+            vertices[corners[i]] = mesh.positions[mesh.positionIndices[i]];
+            if (stCoordinates && mesh.texcoordIndices[i] >= 0)
+                stCoordinates[corners[i]] = mesh.texcoords[mesh.texcoordIndices[i]];
+        }
+    }
+
+    // move a vertex, every triangle using it follows; refitBVH afterwards
+    void setVertex(uint32_t i, const Vector3f& p) { vertices[i] = p; }
 
-        bounding_box = Bounds3(min_vert, max_vert);
+    // instances sharing this mesh may all ask for the BVH at once
+    void buildBVH()
+    {
+        std::call_once(bvhBuilt, [this]() {
+            if (triangles.empty())
+                return;
+            uint64_t settings = BVHAccel::SettingsHash(4, BVHAccel::defaultSplitMethod);
+            size_t size = 0;
+            const char* cached = useCache ? cache.bvhData(settings, size) : nullptr;
+            if (cached)
+                bvh = BVHAccel::FromCache(cached, size, trianglePointers(), 4, BVHAccel::defaultSplitMethod);
+            cache.close();
+            if (!bvh) {
+                bvh = newBVH();
+                if (useCache)
+                    writeCache(settings);
+            }
+            bvh->ReportCost(filename);
+        });
+    }
 
+    // call after moving vertices through setVertex; unlike
+    // buildBVH this must not run concurrently for the same mesh
+    void refitBVH()
+    {
+        area = 0;
+        bounding_box = Bounds3();
+        for (auto& tri : triangles) {
+            area += tri.getArea();
+            bounding_box = Union(bounding_box, tri.getBounds());
+        }
+        if (!bvh)
+            return;
+        bvh->Refit();
+        if (bvh->NeedsRebuild()) {
+            delete bvh;
+            bvh = newBVH();
+        }
+    }
+
+    std::vector<Object*> trianglePointers()
+    {
         std::vector<Object*> ptrs;
-        for (auto& tri : triangles){
+        for (auto& tri : triangles)
             ptrs.push_back(&tri);
-            area += tri.area;
-        }
-        bvh = new BVHAccel(ptrs);
+        return ptrs;
+    }
+
+    BVHAccel* newBVH()
+    {
+        return new BVHAccel(trianglePointers(), 4, BVHAccel::defaultSplitMethod);
     }
 
-    bool intersect(const Ray& ray) { return true; }
+    void writeCache(uint64_t settingsHash)
+    {
+        if (!MeshCache::write(cachePath, contentHash, settingsHash, vertices.get(), stCoordinates.get(),
+                              numVertices, vertexIndex.get(), numTriangles, bvh->Serialize(trianglePointers())))
+            printf(" - could not write %s\n", cachePath.c_str());
+    }
+
+    bool intersect(const Ray& ray) { return bvh && bvh->IntersectP(ray); }
 
     bool intersect(const Ray& ray, float& tnear, uint32_t& index) const
     {
@@ -169,6 +247,10 @@ public:
         Vector3f e0 = normalize(v1 - v0);
         Vector3f e1 = normalize(v2 - v1);
         N = normalize(crossProduct(e0, e1));
+        if (!stCoordinates) {
+            st = Vector2f(0);
+            return;
+        }
         const Vector2f& st0 = stCoordinates[vertexIndex[index * 3]];
         const Vector2f& st1 = stCoordinates[vertexIndex[index * 3 + 1]];
         const Vector2f& st2 = stCoordinates[vertexIndex[index * 3 + 2]];
@@ -196,49 +278,126 @@ public:
     }
     
     void Sample(Intersection &pos, float &pdf){
+        if (!bvh) {
+            pdf = 0.0f;
+            return;
+        }
         bvh->Sample(pos, pdf);
         pos.emit = m->getEmission();
     }
     float getArea(){
         return area;
     }
+    float transformedArea(const Transform& toWorld)
+    {
+        float sum = 0;
+        for (auto& tri : triangles) {
+            Vector3f a, b, c;
+            tri.getVertices(a, b, c);
+            sum += 0.5f * crossProduct(toWorld.Vector(b - a), toWorld.Vector(c - a)).norm();
+        }
+        return sum;
+    }
     bool hasEmit(){
         return m->hasEmission();
     }
+    void collectEmitters(std::vector<Object*> &emitters){
+        if (!hasEmit()) return;
+        for (auto& tri : triangles)
+            emitters.push_back(&tri);
+    }
 
     Bounds3 bounding_box;
+    // shared by all triangles, three vertex indices per triangle;
+    // stCoordinates stays empty when the model has none
     std::unique_ptr<Vector3f[]> vertices;
-    uint32_t numTriangles;
+    uint32_t numVertices = 0;
+    uint32_t numTriangles = 0;
     std::unique_ptr<uint32_t[]> vertexIndex;
     std::unique_ptr<Vector2f[]> stCoordinates;
 
     std::vector<Triangle> triangles;
 
-    BVHAccel* bvh;
+    std::string filename;
+    // triangles and BVH of a previous run, see MeshCache
+    static inline bool useCache = true;
+    std::string cachePath;
+    uint64_t contentHash = 0;
+    MeshCache cache;
+    BVHAccel* bvh = nullptr;
+    std::once_flag bvhBuilt;
     float area;
 
     Material* m;
 };
 
-inline bool Triangle::intersect(const Ray& ray) { return true; }
+inline bool Triangle::getVertices(Vector3f& a, Vector3f& b, Vector3f& c) const
+{
+    const uint32_t* corner = &mesh->vertexIndex[index * 3];
+    a = mesh->vertices[corner[0]];
+    b = mesh->vertices[corner[1]];
+    c = mesh->vertices[corner[2]];
+    return true;
+}
+
+inline Vector3f Triangle::getNormal() const
+{
+    Vector3f v0, v1, v2;
+    getVertices(v0, v1, v2);
+    return normalize(crossProduct(v1 - v0, v2 - v0));
+}
+
+// occlusion test: same culling as getIntersection, hits beyond ray.t_max are ignored
+inline bool Triangle::intersect(const Ray& ray)
+{
+    Vector3f v0, v1, v2;
+    getVertices(v0, v1, v2);
+    Vector3f e1 = v1 - v0, e2 = v2 - v0;
+    if (dotProduct(ray.direction, crossProduct(e1, e2)) > 0)
+        return false;
+    Vector3f pvec = crossProduct(ray.direction, e2);
+    float det = dotProduct(e1, pvec);
+    if (fabs(det) < kMinDeterminant)
+        return false;
+
+    float det_inv = 1.f / det;
+    Vector3f tvec = ray.origin - v0;
+    float u = dotProduct(tvec, pvec) * det_inv;
+    if (u < 0 || u > 1)
+        return false;
+    Vector3f qvec = crossProduct(tvec, e1);
+    float v = dotProduct(ray.direction, qvec) * det_inv;
+    if (v < 0 || u + v > 1)
+        return false;
+    float t_tmp = dotProduct(e2, qvec) * det_inv;
+    return t_tmp > 0 && t_tmp < ray.t_max;
+}
 inline bool Triangle::intersect(const Ray& ray, float& tnear,
                                 uint32_t& index) const
 {
     return false;
 }
 
-inline Bounds3 Triangle::getBounds() { return Union(Bounds3(v0, v1), v2); }
+inline Bounds3 Triangle::getBounds()
+{
+    Vector3f v0, v1, v2;
+    getVertices(v0, v1, v2);
+    return Union(Bounds3(v0, v1), v2);
+}
 
 inline Intersection Triangle::getIntersection(Ray ray)
 {
     Intersection inter;
 
-    if (dotProduct(ray.direction, normal) > 0)
+    Vector3f v0, v1, v2;
+    getVertices(v0, v1, v2);
+    Vector3f e1 = v1 - v0, e2 = v2 - v0;
+    if (dotProduct(ray.direction, crossProduct(e1, e2)) > 0)
         return inter;
     float u, v, t_tmp = 0.f;
     Vector3f pvec = crossProduct(ray.direction, e2);
     float det = dotProduct(e1, pvec);
-    if (fabs(det) < EPSILON) // 如果行列式为0
+    if (fabs(det) < kMinDeterminant) // 如果行列式为0
         return inter;
 
     float det_inv = 1.f / det;
@@ -254,18 +413,51 @@ inline Intersection Triangle::getIntersection(Ray ray)
     if (t_tmp <= 0) 
         return inter;
     // TODO find ray triangle intersection
+    return getIntersectionAt(ray, t_tmp, u, v);
+}
+
+inline Intersection Triangle::getIntersectionAt(const Ray& ray, float t, float u, float v)
+{
+    Intersection inter;
     inter.happened = true;
-    inter.distance = t_tmp;
-    inter.coords = ray.origin + t_tmp * ray.direction; // (1-u-v)*v0 + u*v1 + v*v2
-    inter.normal = normal;
-    inter.m = m;
+    inter.distance = t;
+    inter.coords = ray.origin + t * ray.direction; // (1-u-v)*v0 + u*v1 + v*v2
+    inter.normal = getNormal();
+    inter.m = mesh->m;
     inter.obj = this;
-    inter.emit = m->m_emission;
-    inter.tcoords = (1-u-v)*t0 + u*t1 + v*t2;
+    inter.emit = mesh->m->m_emission;
     return inter;
 }
 
+inline void Triangle::getSurfaceProperties(const Vector3f& P, const Vector3f& I,
+                                           const uint32_t&, const Vector2f& uv,
+                                           Vector3f& N, Vector2f& st) const
+{
+    mesh->getSurfaceProperties(P, I, index, uv, N, st);
+}
+
 inline Vector3f Triangle::evalDiffuseColor(const Vector2f&) const
 {
     return Vector3f(0.5, 0.5, 0.5);
 }
+
+inline void Triangle::Sample(Intersection &pos, float &pdf)
+{
+    Vector3f v0, v1, v2;
+    getVertices(v0, v1, v2);
+    Vector2f u = get_random_float2();
+    float x = std::sqrt(u.x), y = u.y;
+    pos.coords = v0 * (1.0f - x) + v1 * (x * (1.0f - y)) + v2 * (x * y);
+    pos.normal = getNormal();// pos.happened = true;
+    pos.emit = mesh->m->getEmission();
+    pdf = 1.0f / getArea();
+}
+
+inline float Triangle::getArea()
+{
+    Vector3f v0, v1, v2;
+    getVertices(v0, v1, v2);
+    return crossProduct(v1 - v0, v2 - v0).norm() * 0.5f;
+}
+
+inline bool Triangle::hasEmit() { return mesh->m->hasEmission(); }
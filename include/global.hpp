@@ -1,13 +1,17 @@
 #pragma once
 #include <iostream>
 #include <cmath>
-#include <random>
+#include <limits>
+#include "Sampler.hpp"
 
 #undef M_PI
 #define M_PI 3.141592653589793f
 
 extern const float  EPSILON;
 const float kInfinity = std::numeric_limits<float>::max();
+// smallest ray/triangle determinant accepted; it scales with triangle area and
+// ray direction length, so a fixed epsilon would drop small or instanced meshes
+const float kMinDeterminant = std::numeric_limits<float>::min();
 
 inline float clamp(const float &lo, const float &hi, const float &v)
 { return std::max(lo, std::min(hi, v)); }
@@ -28,13 +32,16 @@ inline  bool solveQuadratic(const float &a, const float &b, const float &c, floa
     return true;
 }
 
+// next dimension of the calling thread's current pixel sample, see Sampler
 inline float get_random_float()
 {
-    static std::random_device dev;
-    static std::mt19937 rng(dev());
-    static std::uniform_real_distribution<float> dist(0.f, 1.f); // distribution in range [1, 6]
+    return ThreadSampler().Get1D();
+}
 
-    return dist(rng);
+// two dimensions drawn together, for decisions that need a 2D point
+inline Vector2f get_random_float2()
+{
+    return ThreadSampler().Get2D();
 }
 
 inline void UpdateProgress(float progress)
@@ -51,14 +58,3 @@ inline void UpdateProgress(float progress)
     std::cout << "] " << int(progress * 100.0) << " %\r";
     std::cout.flush();
 };
-
-// // 暂时没用的
-// void hammersley(uint32_t cur_idx, uint32_t sample_count, float& u, float& v) { // 0-1 // 可以理解成[0,1]的均匀采样
-//     u = float(cur_idx) / float(sample_count);
-//     uint32_t bits = (cur_idx << 16u) | (cur_idx >> 16u);
-//     bits = ((bits & 0x55555555u) << 1u) | ((bits & 0xAAAAAAAAu) >> 1u);
-//     bits = ((bits & 0x33333333u) << 2u) | ((bits & 0xCCCCCCCCu) >> 2u);
-//     bits = ((bits & 0x0F0F0F0Fu) << 4u) | ((bits & 0xF0F0F0F0u) >> 4u);
-//     bits = ((bits & 0x00FF00FFu) << 8u) | ((bits & 0xFF00FF00u) >> 8u);
-//     v = float(bits) * 2.3283064365386963e-10;
-// }
@@ -1,131 +1,1474 @@
 #include <algorithm>
 #include <cassert>
+#include <chrono>
+#include <cstring>
+#include <future>
+#include <limits>
+#include <thread>
+#include <unordered_map>
 #include "BVH.hpp"
+#include "MeshCache.hpp"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define RAYTRACING_SSE 1
+#include <emmintrin.h>
+#else
+#define RAYTRACING_SSE 0
+#endif
+
+struct BVHPrimitiveInfo {
+    BVHPrimitiveInfo() {}
+    BVHPrimitiveInfo(int primitiveNumber, const Bounds3 &bounds, float area)
+        : primitiveNumber(primitiveNumber), bounds(bounds),
+          centroid(bounds.Centroid()), area(area) {}
+    int primitiveNumber;
+    Bounds3 bounds;
+    Vector3f centroid;
+    float area;
+    // extra reference made by an SBVH spatial split, it carries no area
+    bool duplicate = false;
+};
+
+// build threads running besides the callers', shared by every BVH under
+// construction so nested and concurrent builds do not oversubscribe
+static std::atomic<int> activeBuildTasks(0);
+
+static bool tryStartBuildTask()
+{
+    static const int maxTasks = std::max(1u, std::thread::hardware_concurrency()) - 1;
+    int active = activeBuildTasks.load();
+    while (active < maxTasks) {
+        if (activeBuildTasks.compare_exchange_weak(active, active + 1))
+            return true;
+    }
+    return false;
+}
+
+// run body(i) for every i in [0, count) on the calling thread and on as many
+// extra build threads as are free
+template <typename Body>
+static void parallelBuildFor(int count, const Body &body)
+{
+    std::atomic<int> next(0);
+    auto worker = [&]() {
+        for (int i = next++; i < count; i = next++)
+            body(i);
+    };
+    std::vector<std::future<void>> helpers;
+    while ((int)helpers.size() + 1 < count && tryStartBuildTask())
+        helpers.push_back(std::async(std::launch::async, [&]() {
+            worker();
+            activeBuildTasks--;
+        }));
+    worker();
+    for (auto &helper : helpers)
+        helper.get();
+}
+
+// traversal stacks hold this many binary levels; builders fall back to
+// splitting by index in the middle before a tree could get any deeper
+constexpr int maxTreeDepth = 64;
+
+// whether splitting n primitives at depth any further than by halves could
+// exceed maxTreeDepth
+static bool nearDepthLimit(int depth, int n)
+{
+    int levels = 0;
+    while ((int64_t(1) << levels) < n)
+        levels++;
+    return depth + levels >= maxTreeDepth - 1;
+}
+
+// deepest level below node, 0 for a leaf
+static int subtreeDepth(const BVHBuildNode* node)
+{
+    if (node->nPrimitives > 0)
+        return 0;
+    return 1 + std::max(subtreeDepth(node->left), subtreeDepth(node->right));
+}
+
+struct BucketInfo {
+    int count = 0;
+    Bounds3 bounds;
+};
+
+// best binned SAH split of a node's references by centroid, references in
+// buckets up to bucket go left; axis stays -1 when no axis separates them
+struct ObjectSplit {
+    float cost = kInfinity;
+    int axis = -1, bucket = -1;
+    Bounds3 left, right;
+};
+
+static int centroidBucket(const BVHPrimitiveInfo &pi, const Bounds3 &centroidBounds, int axis, int nBuckets)
+{
+    int b = nBuckets * centroidBounds.Offset(pi.centroid)[axis];
+    return std::min(b, nBuckets - 1);
+}
+
+// spread the low 10 bits of x out to every third bit
+static inline uint32_t LeftShift3(uint32_t x)
+{
+    x &= 0x3ff;
+    x = (x | (x << 16)) & 0x30000ff;
+    x = (x | (x << 8)) & 0x300f00f;
+    x = (x | (x << 4)) & 0x30c30c3;
+    x = (x | (x << 2)) & 0x9249249;
+    return x;
+}
+
+// 30-bit code, bit b splits along axis b % 3
+static inline uint32_t EncodeMorton3(const Vector3f &v)
+{
+    return (LeftShift3(v.z) << 2) | (LeftShift3(v.y) << 1) | LeftShift3(v.x);
+}
+
+struct MortonPrimitive {
+    uint32_t mortonCode;
+    int index;
+};
+
+// LSD radix sort on the 30 code bits, six bits per pass
+static void RadixSort(std::vector<MortonPrimitive> &v)
+{
+    constexpr int bitsPerPass = 6;
+    constexpr int nBuckets = 1 << bitsPerPass;
+    constexpr int bitMask = nBuckets - 1;
+    std::vector<MortonPrimitive> temp(v.size());
+    for (int pass = 0; pass < 30 / bitsPerPass; ++pass) {
+        int lowBit = pass * bitsPerPass;
+        int bucketCount[nBuckets] = {0};
+        for (const MortonPrimitive &mp : v)
+            bucketCount[(mp.mortonCode >> lowBit) & bitMask]++;
+        int outIndex[nBuckets];
+        outIndex[0] = 0;
+        for (int i = 1; i < nBuckets; ++i)
+            outIndex[i] = outIndex[i - 1] + bucketCount[i - 1];
+        for (const MortonPrimitive &mp : v)
+            temp[outIndex[(mp.mortonCode >> lowBit) & bitMask]++] = mp;
+        v.swap(temp);
+    }
+}
+
+// bounds of the part of prim between lo and hi along axis, limited to the
+// reference's current bounds; triangles are clipped exactly, anything else
+// just has its box cut
+static Bounds3 clipToSlab(Object* prim, const Bounds3 &refBounds, int axis, float lo, float hi)
+{
+    Bounds3 clipped;
+    Vector3f v[3];
+    if (prim->getVertices(v[0], v[1], v[2])) {
+        // vertices inside the slab plus the edge crossings of its two planes
+        for (int i = 0; i < 3; ++i) {
+            const Vector3f &a = v[i], &b = v[(i + 1) % 3];
+            if (a[axis] >= lo && a[axis] <= hi)
+                clipped = Union(clipped, a);
+            for (float plane : {lo, hi}) {
+                if ((a[axis] < plane) != (b[axis] < plane)) {
+                    Vector3f p = a + (b - a) * float((plane - a[axis]) / (b[axis] - a[axis]));
+                    p[axis] = plane;
+                    clipped = Union(clipped, p);
+                }
+            }
+        }
+    }
+    else {
+        clipped = refBounds;
+    }
+    for (int i = 0; i < 3; ++i) {
+        clipped.pMin[i] = std::max<float>(clipped.pMin[i], refBounds.pMin[i]);
+        clipped.pMax[i] = std::min<float>(clipped.pMax[i], refBounds.pMax[i]);
+    }
+    clipped.pMin[axis] = std::max<float>(clipped.pMin[axis], lo);
+    clipped.pMax[axis] = std::min<float>(clipped.pMax[axis], hi);
+    return clipped;
+}
+
+static bool isEmpty(const Bounds3 &b)
+{
+    return b.pMin.x > b.pMax.x || b.pMin.y > b.pMax.y || b.pMin.z > b.pMax.z;
+}
 
 BVHAccel::BVHAccel(std::vector<Object*> p, int maxPrimsInNode,
-                   SplitMethod splitMethod)
+                   SplitMethod splitMethod, int nBuckets, float traversalCost)
     : maxPrimsInNode(std::min(255, maxPrimsInNode)), splitMethod(splitMethod),
+      nBuckets(std::max(2, nBuckets)), traversalCost(traversalCost),
       primitives(std::move(p))
 {
-    root = recursiveBuild(primitives);
+    if (primitives.empty())
+        return;
+    auto start = std::chrono::steady_clock::now();
+
+    Vector3f a, b, c;
+    packTriangles = std::all_of(primitives.begin(), primitives.end(),
+                                [&](Object* prim) { return prim->getVertices(a, b, c); });
+
+    std::vector<BVHPrimitiveInfo> primitiveInfo(primitives.size());
+    for (int i = 0; i < (int)primitives.size(); ++i)
+        primitiveInfo[i] = BVHPrimitiveInfo(i, primitives[i]->getBounds(), primitives[i]->getArea());
+    std::atomic<int> nodeCount(0);
+    BVHBuildNode* root;
+    if (splitMethod == SplitMethod::HLBVH) {
+        root = HLBVHBuild(primitiveInfo, nodeCount);
+    }
+    else if (splitMethod == SplitMethod::SBVH) {
+        // references can be duplicated, so leaves collect them in a new array
+        Bounds3 bounds;
+        for (const BVHPrimitiveInfo &pi : primitiveInfo)
+            bounds = Union(bounds, pi.bounds);
+        int refBudget = spatialSplitBudget * primitives.size();
+        std::vector<BVHPrimitiveInfo> orderedRefs;
+        orderedRefs.reserve(primitives.size() + refBudget);
+        root = spatialBuild(primitiveInfo, 0, bounds.SurfaceArea(), orderedRefs, refBudget, nodeCount);
+        primitiveInfo.swap(orderedRefs);
+        duplicateRef.resize(primitiveInfo.size());
+        for (size_t i = 0; i < primitiveInfo.size(); ++i)
+            duplicateRef[i] = primitiveInfo[i].duplicate;
+    }
+    else {
+        root = recursiveBuild(primitiveInfo, 0, primitives.size(), 0, nodeCount);
+    }
+    totalNodes = nodeCount;
+
+    // leaves index into primitives, so store them in build order
+    std::vector<Object*> orderedPrims(primitiveInfo.size());
+    for (size_t i = 0; i < primitiveInfo.size(); ++i)
+        orderedPrims[i] = primitives[primitiveInfo[i].primitiveNumber];
+    primitives.swap(orderedPrims);
+
+    // compact the pointer tree into a depth-first array and free it
+    nodes.resize(totalNodes);
+    nodeArea.resize(totalNodes);
+    int offset = 0;
+    flattenBVHTree(root, offset);
+    assert(offset == totalNodes);
+    delete root;
+    if (packTriangles)
+        packLeafTriangles();
+    SetAccelerator(defaultAccelerator);
+    builtSAHCost = SAHCost();
+
+    auto stop = std::chrono::steady_clock::now();
+    buildMilliseconds = std::chrono::duration<double, std::milli>(stop - start).count();
+}
+
+BVHAccel::~BVHAccel() {}
+
+Bounds3 BVHAccel::WorldBound() const
+{
+    return nodes.empty() ? Bounds3() : nodes[0].bounds;
+}
+
+ObjectSplit BVHAccel::findObjectSplit(const BVHPrimitiveInfo* refs, int count, const Bounds3 &bounds,
+                                      const Bounds3 &centroidBounds) const
+{
+    ObjectSplit best;
+    float invArea = 1.f / bounds.SurfaceArea();
+    for (int axis = 0; axis < 3; ++axis) {
+        if (centroidBounds.pMax[axis] == centroidBounds.pMin[axis])
+            continue;
+        std::vector<BucketInfo> buckets(nBuckets);
+        for (int i = 0; i < count; ++i) {
+            int b = centroidBucket(refs[i], centroidBounds, axis, nBuckets);
+            buckets[b].count++;
+            buckets[b].bounds = Union(buckets[b].bounds, refs[i].bounds);
+        }
+
+        // cost of splitting after bucket i, with one primitive test as unit
+        // cost; the right-hand sides are swept once from the back
+        std::vector<Bounds3> rightBounds(nBuckets);
+        std::vector<int> rightCount(nBuckets);
+        Bounds3 b1;
+        int count1 = 0;
+        for (int i = nBuckets - 1; i > 0; --i) {
+            b1 = Union(b1, buckets[i].bounds);
+            count1 += buckets[i].count;
+            rightBounds[i] = b1;
+            rightCount[i] = count1;
+        }
+        Bounds3 b0;
+        int count0 = 0;
+        for (int i = 0; i < nBuckets - 1; ++i) {
+            b0 = Union(b0, buckets[i].bounds);
+            count0 += buckets[i].count;
+            if (count0 == 0 || rightCount[i + 1] == 0)
+                continue;
+            float cost = traversalCost + (primCost(count0) * b0.SurfaceArea() +
+                                          primCost(rightCount[i + 1]) * rightBounds[i + 1].SurfaceArea()) * invArea;
+            if (cost < best.cost) {
+                best.cost = cost;
+                best.axis = axis;
+                best.bucket = i;
+                best.left = b0;
+                best.right = rightBounds[i + 1];
+            }
+        }
+    }
+    return best;
 }
 
-BVHBuildNode* BVHAccel::recursiveBuild(std::vector<Object*> objects)
+BVHBuildNode* BVHAccel::recursiveBuild(std::vector<BVHPrimitiveInfo> &primitiveInfo,
+                                       int start, int end, int depth, std::atomic<int> &totalNodes)
 {
     BVHBuildNode* node = new BVHBuildNode();
+    totalNodes++;
 
     // Compute bounds of all primitives in BVH node
     Bounds3 bounds;
-    for (int i = 0; i < objects.size(); ++i)
-        bounds = Union(bounds, objects[i]->getBounds());
-    if (objects.size() == 1) {
-        // Create leaf _BVHBuildNode_
-        node->bounds = objects[0]->getBounds();
-        node->object = objects[0];
-        node->left = nullptr;
-        node->right = nullptr;
-        node->area = objects[0]->getArea();
-        return node;
+    float area = 0;
+    for (int i = start; i < end; ++i) {
+        bounds = Union(bounds, primitiveInfo[i].bounds);
+        area += primitiveInfo[i].area;
     }
-    else if (objects.size() == 2) {
-        node->left = recursiveBuild(std::vector{objects[0]});
-        node->right = recursiveBuild(std::vector{objects[1]});
-        node->object = nullptr;
-        node->bounds = Union(node->left->bounds, node->right->bounds);
-        node->area = node->left->area + node->right->area;
+    int nPrimitives = end - start;
+    auto makeLeaf = [&]() {
+        node->bounds = bounds;
+        node->area = area;
+        node->firstPrimOffset = start;
+        node->nPrimitives = nPrimitives;
         return node;
+    };
+    // anything larger is a leaf or split by cost below
+    if (nPrimitives == 1)
+        return makeLeaf();
+
+    Bounds3 centroidBounds;
+    for (int i = start; i < end; ++i)
+        centroidBounds = Union(centroidBounds, primitiveInfo[i].centroid);
+    int dim = centroidBounds.maxExtent();
+    // where all centroids coincide no split can separate them, and close to
+    // the depth limit only halving keeps the tree shallow enough; leaves
+    // stay within maxPrimsInNode either way
+    bool splitByIndex = centroidBounds.pMax[dim] == centroidBounds.pMin[dim] ||
+                        nearDepthLimit(depth, nPrimitives);
+    if (splitByIndex && nPrimitives <= maxPrimsInNode)
+        return makeLeaf();
+
+    int mid = (start + end) / 2;
+    if (splitByIndex) {
+        // any order is a valid partition, the halves are left as they are
     }
-    else {
-        Bounds3 centroidBounds;
-        for (int i = 0; i < objects.size(); ++i)
-            centroidBounds =
-                Union(centroidBounds, objects[i]->getBounds().Centroid());
-        int dim = centroidBounds.maxExtent();
-        switch (dim) {
-        case 0:
-            std::sort(objects.begin(), objects.end(), [](auto f1, auto f2) {
-                return f1->getBounds().Centroid().x <
-                       f2->getBounds().Centroid().x;
+    else if (splitMethod == SplitMethod::SAH) {
+        ObjectSplit split = findObjectSplit(&primitiveInfo[start], nPrimitives, bounds, centroidBounds);
+        // split when the node is too big for a leaf or splitting is cheaper
+        if (split.axis < 0 || (nPrimitives <= maxPrimsInNode && primCost(nPrimitives) <= split.cost))
+            return makeLeaf();
+        dim = split.axis;
+        auto pmid = std::partition(
+            &primitiveInfo[start], &primitiveInfo[end - 1] + 1,
+            [&](const BVHPrimitiveInfo &pi) {
+                return centroidBucket(pi, centroidBounds, dim, nBuckets) <= split.bucket;
             });
-            break;
-        case 1:
-            std::sort(objects.begin(), objects.end(), [](auto f1, auto f2) {
-                return f1->getBounds().Centroid().y <
-                       f2->getBounds().Centroid().y;
-            });
-            break;
-        case 2:
-            std::sort(objects.begin(), objects.end(), [](auto f1, auto f2) {
-                return f1->getBounds().Centroid().z <
-                       f2->getBounds().Centroid().z;
-            });
-            break;
+        mid = pmid - &primitiveInfo[0];
+    }
+    else {
+        if (nPrimitives <= maxPrimsInNode)
+            return makeLeaf();
+        // median split on the longest centroid axis
+        std::nth_element(&primitiveInfo[start], &primitiveInfo[mid],
+                         &primitiveInfo[end - 1] + 1,
+                         [dim](const BVHPrimitiveInfo &a, const BVHPrimitiveInfo &b) {
+                             return a.centroid[dim] < b.centroid[dim];
+                         });
+    }
+
+    assert(start < mid && mid < end);
+    node->splitAxis = dim;
+    // both halves own disjoint ranges of primitiveInfo, so large ones can be
+    // built on another thread without copying anything
+    if (nPrimitives >= parallelBuildThreshold && tryStartBuildTask()) {
+        auto left = std::async(std::launch::async, [&]() {
+            BVHBuildNode* subtree = recursiveBuild(primitiveInfo, start, mid, depth + 1, totalNodes);
+            activeBuildTasks--;
+            return subtree;
+        });
+        node->right = recursiveBuild(primitiveInfo, mid, end, depth + 1, totalNodes);
+        node->left = left.get();
+    }
+    else {
+        node->left = recursiveBuild(primitiveInfo, start, mid, depth + 1, totalNodes);
+        node->right = recursiveBuild(primitiveInfo, mid, end, depth + 1, totalNodes);
+    }
+    node->bounds = Union(node->left->bounds, node->right->bounds);
+    node->area = node->left->area + node->right->area;
+
+    return node;
+}
+
+BVHBuildNode* BVHAccel::spatialBuild(std::vector<BVHPrimitiveInfo> &refs, int depth, float rootArea,
+                                     std::vector<BVHPrimitiveInfo> &orderedRefs, int &refBudget,
+                                     std::atomic<int> &totalNodes)
+{
+    // spatial splits are only tried where object split children overlap by
+    // more than this fraction of the root area, and not too deep for the
+    // traversal stacks
+    constexpr float spatialSplitAlpha = 1e-5f;
+    constexpr int maxSpatialSplitDepth = 32;
+
+    BVHBuildNode* node = new BVHBuildNode();
+    totalNodes++;
+    Bounds3 bounds, centroidBounds;
+    float area = 0;
+    for (const BVHPrimitiveInfo &ref : refs) {
+        bounds = Union(bounds, ref.bounds);
+        centroidBounds = Union(centroidBounds, ref.centroid);
+        area += ref.area;
+    }
+    int nRefs = refs.size();
+    auto makeLeaf = [&]() {
+        node->bounds = bounds;
+        node->area = area;
+        node->firstPrimOffset = orderedRefs.size();
+        node->nPrimitives = nRefs;
+        orderedRefs.insert(orderedRefs.end(), refs.begin(), refs.end());
+        return node;
+    };
+    if (nRefs == 1)
+        return makeLeaf();
+    float invArea = 1.f / bounds.SurfaceArea();
+
+    // object split: binned SAH over centroids, as in recursiveBuild
+    ObjectSplit objectSplit = findObjectSplit(refs.data(), nRefs, bounds, centroidBounds);
+    int objectDim = objectSplit.axis >= 0 ? objectSplit.axis : centroidBounds.maxExtent();
+    float objectCost = objectSplit.cost;
+    int objectBucket = objectSplit.bucket;
+    const Bounds3 &objectLeft = objectSplit.left, &objectRight = objectSplit.right;
+    auto bucketOf = [&](const BVHPrimitiveInfo &ref) {
+        return centroidBucket(ref, centroidBounds, objectDim, nBuckets);
+    };
+
+    // spatial split: bin the node bounds and clip every reference into the
+    // bins it straddles, references entering left of a plane count on the
+    // left and those leaving right of it on the right
+    float spatialCost = kInfinity;
+    int spatialDim = -1;
+    float spatialPos = 0;
+    bool overlapping = true;
+    if (objectBucket >= 0) {
+        Bounds3 overlap;
+        for (int i = 0; i < 3; ++i) {
+            overlap.pMin[i] = std::max<float>(objectLeft.pMin[i], objectRight.pMin[i]);
+            overlap.pMax[i] = std::min<float>(objectLeft.pMax[i], objectRight.pMax[i]);
+        }
+        overlapping = !isEmpty(overlap) && overlap.SurfaceArea() > spatialSplitAlpha * rootArea;
+    }
+    if (overlapping && refBudget > 0 && depth < maxSpatialSplitDepth) {
+        struct SpatialBin {
+            Bounds3 bounds;
+            int enter = 0, exit = 0;
+        };
+        for (int dim = 0; dim < 3; ++dim) {
+            float lo = bounds.pMin[dim], extent = bounds.pMax[dim] - bounds.pMin[dim];
+            if (!(extent > 0))
+                continue;
+            auto binOf = [&](float x) {
+                int b = nBuckets * ((x - lo) / extent);
+                return std::max(0, std::min(b, nBuckets - 1));
+            };
+            auto binPlane = [&](int b) { return b == nBuckets ? float(bounds.pMax[dim]) : lo + extent * b / nBuckets; };
+            std::vector<SpatialBin> bins(nBuckets);
+            for (const BVHPrimitiveInfo &ref : refs) {
+                int first = binOf(ref.bounds.pMin[dim]), last = binOf(ref.bounds.pMax[dim]);
+                Object* prim = primitives[ref.primitiveNumber];
+                for (int b = first; b <= last; ++b) {
+                    Bounds3 part = first == last ? ref.bounds
+                                                 : clipToSlab(prim, ref.bounds, dim, binPlane(b), binPlane(b + 1));
+                    if (!isEmpty(part))
+                        bins[b].bounds = Union(bins[b].bounds, part);
+                }
+                bins[first].enter++;
+                bins[last].exit++;
+            }
+            std::vector<Bounds3> rightBounds(nBuckets);
+            std::vector<int> rightCount(nBuckets);
+            Bounds3 b1;
+            int count1 = 0;
+            for (int i = nBuckets - 1; i > 0; --i) {
+                b1 = Union(b1, bins[i].bounds);
+                count1 += bins[i].exit;
+                rightBounds[i] = b1;
+                rightCount[i] = count1;
+            }
+            Bounds3 b0;
+            int count0 = 0;
+            for (int i = 0; i < nBuckets - 1; ++i) {
+                b0 = Union(b0, bins[i].bounds);
+                count0 += bins[i].enter;
+                if (count0 == 0 || rightCount[i + 1] == 0)
+                    continue;
+                float cost = traversalCost + (primCost(count0) * b0.SurfaceArea() +
+                                              primCost(rightCount[i + 1]) * rightBounds[i + 1].SurfaceArea()) * invArea;
+                if (cost < spatialCost) {
+                    spatialCost = cost;
+                    spatialDim = dim;
+                    spatialPos = binPlane(i + 1);
+                }
+            }
+        }
+    }
+
+    // split when the node is too big for a leaf or splitting is cheaper
+    if (nRefs <= maxPrimsInNode && primCost(nRefs) <= std::min(objectCost, spatialCost))
+        return makeLeaf();
+
+    std::vector<BVHPrimitiveInfo> left, right;
+    int dim = objectDim;
+    // as in recursiveBuild, halve nodes nothing else can split or that are
+    // close to the depth limit
+    bool splitByIndex = objectBucket < 0 && !(spatialCost < objectCost);
+    if (splitByIndex || nearDepthLimit(depth, nRefs)) {
+        if (nRefs <= maxPrimsInNode)
+            return makeLeaf();
+        left.assign(refs.begin(), refs.begin() + nRefs / 2);
+        right.assign(refs.begin() + nRefs / 2, refs.end());
+    }
+    else if (spatialCost < objectCost) {
+        dim = spatialDim;
+        for (const BVHPrimitiveInfo &ref : refs) {
+            if (ref.bounds.pMax[dim] <= spatialPos) {
+                left.push_back(ref);
+            }
+            else if (ref.bounds.pMin[dim] >= spatialPos) {
+                right.push_back(ref);
+            }
+            else if (refBudget > 0) {
+                // the right half becomes the duplicate, so sampling sees
+                // every primitive exactly once
+                Object* prim = primitives[ref.primitiveNumber];
+                Bounds3 lb = clipToSlab(prim, ref.bounds, dim, -kInfinity, spatialPos);
+                Bounds3 rb = clipToSlab(prim, ref.bounds, dim, spatialPos, kInfinity);
+                if (isEmpty(lb) || isEmpty(rb)) {
+                    (isEmpty(lb) ? right : left).push_back(ref);
+                    continue;
+                }
+                refBudget--;
+                BVHPrimitiveInfo lref(ref.primitiveNumber, lb, ref.area);
+                lref.duplicate = ref.duplicate;
+                BVHPrimitiveInfo rref(ref.primitiveNumber, rb, 0.f);
+                rref.duplicate = true;
+                left.push_back(lref);
+                right.push_back(rref);
+            }
+            else {
+                (ref.centroid[dim] < spatialPos ? left : right).push_back(ref);
+            }
+        }
+        if (left.empty() || right.empty()) {
+            left.clear();
+            right.clear();
+            dim = objectDim;
+        }
+    }
+    if (left.empty()) {
+        if (objectBucket >= 0) {
+            for (const BVHPrimitiveInfo &ref : refs)
+                (bucketOf(ref) <= objectBucket ? left : right).push_back(ref);
+        }
+        else if (nRefs <= maxPrimsInNode) {
+            return makeLeaf();
+        }
+        else {
+            left.assign(refs.begin(), refs.begin() + nRefs / 2);
+            right.assign(refs.begin() + nRefs / 2, refs.end());
+        }
+    }
+    // the children own their references from here on
+    std::vector<BVHPrimitiveInfo>().swap(refs);
+
+    node->splitAxis = dim;
+    node->left = spatialBuild(left, depth + 1, rootArea, orderedRefs, refBudget, totalNodes);
+    node->right = spatialBuild(right, depth + 1, rootArea, orderedRefs, refBudget, totalNodes);
+    node->bounds = Union(node->left->bounds, node->right->bounds);
+    node->area = node->left->area + node->right->area;
+    return node;
+}
+
+BVHBuildNode* BVHAccel::HLBVHBuild(std::vector<BVHPrimitiveInfo> &primitiveInfo,
+                                   std::atomic<int> &totalNodes)
+{
+    // quantize centroids to a 1024^3 grid over their bounds and sort along
+    // the Z-order curve
+    Bounds3 centroidBounds;
+    for (const BVHPrimitiveInfo &pi : primitiveInfo)
+        centroidBounds = Union(centroidBounds, pi.centroid);
+    std::vector<MortonPrimitive> mortonPrims(primitiveInfo.size());
+    for (int i = 0; i < (int)primitiveInfo.size(); ++i) {
+        Vector3f o = centroidBounds.Offset(primitiveInfo[i].centroid) * 1024.f;
+        o = Vector3f(std::min(o.x, 1023.f), std::min(o.y, 1023.f), std::min(o.z, 1023.f));
+        mortonPrims[i] = {EncodeMorton3(o), i};
+    }
+    RadixSort(mortonPrims);
+
+    // leaves index primitiveInfo like the other builders, so store it in
+    // Morton order with the codes alongside
+    std::vector<BVHPrimitiveInfo> sortedInfo(primitiveInfo.size());
+    std::vector<uint32_t> codes(primitiveInfo.size());
+    for (int i = 0; i < (int)mortonPrims.size(); ++i) {
+        sortedInfo[i] = primitiveInfo[mortonPrims[i].index];
+        codes[i] = mortonPrims[i].mortonCode;
+    }
+    primitiveInfo.swap(sortedInfo);
+
+    // primitives sharing the top 12 bits form a treelet, each built
+    // independently from the remaining bits
+    constexpr uint32_t treeletMask = 0x3ffc0000;
+    constexpr int firstBitIndex = 29 - 12;
+    std::vector<std::pair<int, int>> treeletRanges;
+    for (int start = 0, end = 1; end <= (int)codes.size(); ++end) {
+        if (end == (int)codes.size() || (codes[start] & treeletMask) != (codes[end] & treeletMask)) {
+            treeletRanges.emplace_back(start, end);
+            start = end;
         }
+    }
+    std::vector<BVHBuildNode*> treelets(treeletRanges.size());
+    parallelBuildFor(treelets.size(), [&](int i) {
+        treelets[i] = emitLBVH(primitiveInfo, codes, treeletRanges[i].first,
+                               treeletRanges[i].second, firstBitIndex, totalNodes);
+    });
+
+    // and the few thousand treelets at most are joined with SAH, leaving
+    // room for the deepest of them below
+    int reserve = 0;
+    for (const BVHBuildNode* treelet : treelets)
+        reserve = std::max(reserve, subtreeDepth(treelet));
+    return buildUpperSAH(treelets, 0, treelets.size(), 0, reserve, totalNodes);
+}
+
+BVHBuildNode* BVHAccel::emitLBVH(std::vector<BVHPrimitiveInfo> &primitiveInfo,
+                                 const std::vector<uint32_t> &codes, int start, int end,
+                                 int bitIndex, std::atomic<int> &totalNodes)
+{
+    int nPrimitives = end - start;
+    if (nPrimitives <= maxPrimsInNode) {
+        BVHBuildNode* node = new BVHBuildNode();
+        totalNodes++;
+        node->area = 0;
+        for (int i = start; i < end; ++i) {
+            node->bounds = Union(node->bounds, primitiveInfo[i].bounds);
+            node->area += primitiveInfo[i].area;
+        }
+        node->firstPrimOffset = start;
+        node->nPrimitives = nPrimitives;
+        return node;
+    }
 
-        auto beginning = objects.begin();
-        auto middling = objects.begin() + (objects.size() / 2);
-        auto ending = objects.end();
+    int mid, axis;
+    if (bitIndex < 0) {
+        // codes exhausted, the primitives share a grid cell
+        mid = (start + end) / 2;
+        axis = 0;
+    }
+    else {
+        uint32_t mask = 1u << bitIndex;
+        // codes are sorted, so equal ends mean no split on this bit
+        if ((codes[start] & mask) == (codes[end - 1] & mask))
+            return emitLBVH(primitiveInfo, codes, start, end, bitIndex - 1, totalNodes);
+        mid = std::partition_point(codes.begin() + start, codes.begin() + end,
+                                   [mask](uint32_t code) { return !(code & mask); }) - codes.begin();
+        axis = bitIndex % 3;
+    }
+
+    BVHBuildNode* node = new BVHBuildNode();
+    totalNodes++;
+    node->splitAxis = axis;
+    node->left = emitLBVH(primitiveInfo, codes, start, mid, bitIndex - 1, totalNodes);
+    node->right = emitLBVH(primitiveInfo, codes, mid, end, bitIndex - 1, totalNodes);
+    node->bounds = Union(node->left->bounds, node->right->bounds);
+    node->area = node->left->area + node->right->area;
+    return node;
+}
+
+BVHBuildNode* BVHAccel::buildUpperSAH(std::vector<BVHBuildNode*> &treelets, int start, int end, int depth, int reserve,
+                                      std::atomic<int> &totalNodes)
+{
+    int nNodes = end - start;
+    if (nNodes == 1)
+        return treelets[start];
 
-        auto leftshapes = std::vector<Object*>(beginning, middling);
-        auto rightshapes = std::vector<Object*>(middling, ending);
+    BVHBuildNode* node = new BVHBuildNode();
+    totalNodes++;
+    Bounds3 bounds, centroidBounds;
+    for (int i = start; i < end; ++i) {
+        bounds = Union(bounds, treelets[i]->bounds);
+        centroidBounds = Union(centroidBounds, treelets[i]->bounds.Centroid());
+    }
+    int dim = centroidBounds.maxExtent();
 
-        assert(objects.size() == (leftshapes.size() + rightshapes.size()));
+    // same binned sweep as recursiveBuild with each treelet as one unit
+    auto bucketOf = [&](const BVHBuildNode* treelet) {
+        int b = nBuckets * centroidBounds.Offset(treelet->bounds.Centroid())[dim];
+        return std::min(b, nBuckets - 1);
+    };
+    std::vector<BucketInfo> buckets(nBuckets);
+    for (int i = start; i < end; ++i) {
+        int b = bucketOf(treelets[i]);
+        buckets[b].count++;
+        buckets[b].bounds = Union(buckets[b].bounds, treelets[i]->bounds);
+    }
+    std::vector<float> rightArea(nBuckets);
+    std::vector<int> rightCount(nBuckets);
+    Bounds3 b1;
+    int count1 = 0;
+    for (int i = nBuckets - 1; i > 0; --i) {
+        b1 = Union(b1, buckets[i].bounds);
+        count1 += buckets[i].count;
+        rightArea[i] = b1.SurfaceArea();
+        rightCount[i] = count1;
+    }
+    float minCost = kInfinity;
+    int minCostSplitBucket = -1;
+    Bounds3 b0;
+    int count0 = 0;
+    for (int i = 0; i < nBuckets - 1; ++i) {
+        b0 = Union(b0, buckets[i].bounds);
+        count0 += buckets[i].count;
+        if (count0 == 0 || rightCount[i + 1] == 0)
+            continue;
+        float cost = count0 * b0.SurfaceArea() + rightCount[i + 1] * rightArea[i + 1];
+        if (cost < minCost) {
+            minCost = cost;
+            minCostSplitBucket = i;
+        }
+    }
 
-        node->left = recursiveBuild(leftshapes);
-        node->right = recursiveBuild(rightshapes);
-        node->object = nullptr;
-        node->bounds = Union(node->left->bounds, node->right->bounds);
-        node->area = node->left->area + node->right->area;
+    int mid = (start + end) / 2;
+    if (minCostSplitBucket >= 0 && !nearDepthLimit(depth + reserve, nNodes)) {
+        auto pmid = std::partition(
+            treelets.begin() + start, treelets.begin() + end,
+            [&](const BVHBuildNode* treelet) { return bucketOf(treelet) <= minCostSplitBucket; });
+        mid = pmid - treelets.begin();
     }
+    assert(start < mid && mid < end);
 
+    node->splitAxis = dim;
+    node->left = buildUpperSAH(treelets, start, mid, depth + 1, reserve, totalNodes);
+    node->right = buildUpperSAH(treelets, mid, end, depth + 1, reserve, totalNodes);
+    node->bounds = bounds;
+    node->area = node->left->area + node->right->area;
     return node;
 }
 
-Intersection BVHAccel::Intersect(const Ray& ray) const
+int BVHAccel::flattenBVHTree(BVHBuildNode* node, int &offset, int depth)
 {
+    // the builders keep trees shallow and leaves small enough for these
+    assert(depth < maxTreeDepth);
+    assert(node->nPrimitives <= std::numeric_limits<uint16_t>::max());
+    LinearBVHNode* linearNode = &nodes[offset];
+    nodeArea[offset] = node->area;
+    linearNode->bounds = node->bounds;
+    int myOffset = offset++;
+    if (node->nPrimitives > 0) {
+        linearNode->primitivesOffset = node->firstPrimOffset;
+        linearNode->nPrimitives = node->nPrimitives;
+    }
+    else {
+        linearNode->axis = node->splitAxis;
+        linearNode->nPrimitives = 0;
+        flattenBVHTree(node->left, offset, depth + 1);
+        linearNode->secondChildOffset = flattenBVHTree(node->right, offset, depth + 1);
+    }
+    return myOffset;
+}
+
+float BVHAccel::SAHCost() const
+{
+    if (nodes.empty())
+        return 0.f;
+    float cost = 0.f;
+    for (const LinearBVHNode &node : nodes) {
+        if (node.nPrimitives > 0)
+            cost += node.bounds.SurfaceArea() * primCost(node.nPrimitives);
+        else
+            cost += node.bounds.SurfaceArea() * traversalCost;
+    }
+    return cost / nodes[0].bounds.SurfaceArea();
+}
+
+void BVHAccel::Refit()
+{
+    if (nodes.empty())
+        return;
+    // children always follow their parent in the depth-first array, so a
+    // reverse sweep sees both of them before the node itself
+    for (int i = nodes.size() - 1; i >= 0; --i) {
+        LinearBVHNode &node = nodes[i];
+        if (node.nPrimitives > 0) {
+            Bounds3 bounds;
+            float area = 0;
+            for (int j = 0; j < node.nPrimitives; ++j) {
+                bounds = Union(bounds, primitives[node.primitivesOffset + j]->getBounds());
+                area += refArea(node.primitivesOffset + j);
+            }
+            node.bounds = bounds;
+            nodeArea[i] = area;
+        }
+        else {
+            node.bounds = Union(nodes[i + 1].bounds, nodes[node.secondChildOffset].bounds);
+            nodeArea[i] = nodeArea[i + 1] + nodeArea[node.secondChildOffset];
+        }
+    }
+    if (packTriangles)
+        fillPacks();
+    if (!wideNodes.empty())
+        SetAccelerator(Accelerator::BVH4);
+}
+
+float BVHAccel::RefitQuality() const
+{
+    return builtSAHCost > 0 ? SAHCost() / builtSAHCost : 1.f;
+}
+
+// fixed part of a serialized tree, followed by its nodes, node areas,
+// primitive indices, duplicate flags and triangle packs
+struct BVHCacheHeader {
+    uint32_t nNodes;
+    uint32_t nRefs;
+    uint32_t nPacks;
+    uint32_t packTriangles;
+    float builtSAHCost;
+};
+
+uint64_t BVHAccel::SettingsHash(int maxPrimsInNode, SplitMethod splitMethod, int nBuckets, float traversalCost)
+{
+    // layout sizes catch trees written by a build with different node types,
+    // the revision trees built by an older version of the builders
+    constexpr uint32_t builderRevision = 2;
+    struct {
+        int32_t maxPrimsInNode, splitMethod, nBuckets;
+        float traversalCost, spatialSplitBudget;
+        uint32_t nodeSize, packSize, revision;
+    } settings = {std::min(255, maxPrimsInNode), (int32_t)splitMethod, std::max(2, nBuckets), traversalCost,
+                  splitMethod == SplitMethod::SBVH ? spatialSplitBudget : 0.f,
+                  (uint32_t)sizeof(LinearBVHNode), (uint32_t)sizeof(TrianglePack), builderRevision};
+    return HashBytes(&settings, sizeof(settings));
+}
+
+template <typename T>
+static void appendBytes(std::vector<char> &out, const T* data, size_t count)
+{
+    const char* bytes = (const char*)data;
+    out.insert(out.end(), bytes, bytes + count * sizeof(T));
+}
+
+template <typename T>
+static void readBytes(const char* &in, T* data, size_t count)
+{
+    memcpy((void*)data, in, count * sizeof(T));
+    in += count * sizeof(T);
+}
+
+std::vector<char> BVHAccel::Serialize(const std::vector<Object*> &prims) const
+{
+    std::unordered_map<const Object*, int32_t> primIndex;
+    for (size_t i = 0; i < prims.size(); ++i)
+        primIndex[prims[i]] = i;
+    std::vector<int32_t> refs(primitives.size(), -1);
+    std::vector<uint8_t> duplicates(primitives.size(), 0);
+    for (size_t i = 0; i < primitives.size(); ++i) {
+        if (primitives[i])
+            refs[i] = primIndex.at(primitives[i]);
+        if (!duplicateRef.empty())
+            duplicates[i] = duplicateRef[i];
+    }
+
+    BVHCacheHeader header = {(uint32_t)nodes.size(), (uint32_t)primitives.size(), (uint32_t)packs.size(),
+                             packTriangles, builtSAHCost};
+    std::vector<char> out;
+    appendBytes(out, &header, 1);
+    appendBytes(out, nodes.data(), nodes.size());
+    appendBytes(out, nodeArea.data(), nodeArea.size());
+    appendBytes(out, refs.data(), refs.size());
+    appendBytes(out, duplicates.data(), duplicates.size());
+    appendBytes(out, packs.data(), packs.size());
+    return out;
+}
+
+BVHAccel* BVHAccel::FromCache(const char* data, size_t size, const std::vector<Object*> &prims,
+                              int maxPrimsInNode, SplitMethod splitMethod, int nBuckets, float traversalCost)
+{
+    auto start = std::chrono::steady_clock::now();
+    BVHCacheHeader header;
+    if (size < sizeof(header))
+        return nullptr;
+    memcpy(&header, data, sizeof(header));
+    size_t expected = sizeof(header) + header.nNodes * (sizeof(LinearBVHNode) + sizeof(float)) +
+                      header.nRefs * (sizeof(int32_t) + sizeof(uint8_t)) + header.nPacks * sizeof(TrianglePack);
+    if (size != expected || header.nNodes == 0)
+        return nullptr;
+
+    BVHAccel* bvh = new BVHAccel({}, maxPrimsInNode, splitMethod, nBuckets, traversalCost);
+    const char* in = data + sizeof(header);
+    bvh->nodes.resize(header.nNodes);
+    bvh->nodeArea.resize(header.nNodes);
+    readBytes(in, bvh->nodes.data(), header.nNodes);
+    readBytes(in, bvh->nodeArea.data(), header.nNodes);
+    std::vector<int32_t> refs(header.nRefs);
+    std::vector<uint8_t> duplicates(header.nRefs);
+    readBytes(in, refs.data(), header.nRefs);
+    readBytes(in, duplicates.data(), header.nRefs);
+    bvh->packs.resize(header.nPacks);
+    readBytes(in, bvh->packs.data(), header.nPacks);
+
+    // packs cover the references four at a time, only when triangles are packed
+    bool valid = header.packTriangles ? header.nRefs % 4 == 0 && header.nPacks == header.nRefs / 4
+                                      : header.nPacks == 0;
+    bvh->primitives.resize(header.nRefs);
+    for (uint32_t i = 0; i < header.nRefs; ++i) {
+        if (refs[i] >= (int32_t)prims.size())
+            valid = false;
+        else
+            bvh->primitives[i] = refs[i] < 0 ? nullptr : prims[refs[i]];
+    }
+    if (std::find(duplicates.begin(), duplicates.end(), 1) != duplicates.end())
+        bvh->duplicateRef.assign(duplicates.begin(), duplicates.end());
+    // children always follow their parent in depth-first order, so depths
+    // can be propagated in a single forward pass
+    std::vector<int> depth(header.nNodes, 0);
+    for (uint32_t i = 0; i < header.nNodes && valid; ++i) {
+        const LinearBVHNode &node = bvh->nodes[i];
+        if (depth[i] >= maxTreeDepth) {
+            valid = false;
+        }
+        else if (node.nPrimitives > 0) {
+            // packed leaves are read in whole packs
+            int64_t first = node.primitivesOffset;
+            int64_t count = header.packTriangles ? (node.nPrimitives + 3) / 4 * 4 : node.nPrimitives;
+            valid = first >= 0 && (!header.packTriangles || first % 4 == 0) && first + count <= header.nRefs &&
+                    node.nPrimitives <= std::min(255, maxPrimsInNode);
+            for (int64_t k = first; valid && k < first + node.nPrimitives; ++k)
+                valid = bvh->primitives[k] != nullptr;
+        }
+        else if (node.axis < 3 && (int64_t)i + 1 < node.secondChildOffset &&
+                 (int64_t)node.secondChildOffset < header.nNodes) {
+            depth[i + 1] = depth[node.secondChildOffset] = depth[i] + 1;
+        }
+        else {
+            valid = false;
+        }
+    }
+    if (!valid) {
+        delete bvh;
+        return nullptr;
+    }
+
+    bvh->packTriangles = header.packTriangles;
+    bvh->builtSAHCost = header.builtSAHCost;
+    bvh->totalNodes = header.nNodes;
+    bvh->loadedFromCache = true;
+    bvh->SetAccelerator(defaultAccelerator);
+    auto stop = std::chrono::steady_clock::now();
+    bvh->buildMilliseconds = std::chrono::duration<double, std::milli>(stop - start).count();
+    return bvh;
+}
+
+void BVHAccel::ReportCost(const std::string &name) const
+{
+    std::vector<Object*> prims;
+    int nRefs = 0;
+    for (size_t i = 0; i < primitives.size(); ++i) {
+        if (!primitives[i])
+            continue;
+        nRefs++;
+        if (duplicateRef.empty() || !duplicateRef[i])
+            prims.push_back(primitives[i]);
+    }
+    static const char* methodNames[] = {"median", "SAH", "HLBVH", "SBVH"};
+    printf(" - BVH %s: %d prims, %d nodes (%d BVH4 nodes), %s %s in %.2f ms, SAH cost %.3f",
+           name.c_str(), (int)prims.size(), totalNodes, (int)wideNodes.size(), methodNames[(int)splitMethod],
+           loadedFromCache ? "loaded" : "built", buildMilliseconds, SAHCost());
+    if (compareWithMedian && !loadedFromCache) {
+        BVHAccel median(prims, maxPrimsInNode, SplitMethod::NAIVE, nBuckets, traversalCost);
+        printf(" (median split %.3f)", median.SAHCost());
+    }
+    printf("\n");
+    if (nRefs > (int)prims.size())
+        printf("   %d references after spatial splits (+%.1f%%)\n", nRefs,
+               100.f * (nRefs - (int)prims.size()) / prims.size());
+}
+
+void BVHAccel::packLeafTriangles()
+{
+    std::vector<Object*> padded;
+    std::vector<bool> paddedDuplicates;
+    for (LinearBVHNode &node : nodes) {
+        if (node.nPrimitives == 0)
+            continue;
+        int offset = padded.size();
+        for (int i = 0; i < node.nPrimitives; ++i) {
+            padded.push_back(primitives[node.primitivesOffset + i]);
+            if (!duplicateRef.empty())
+                paddedDuplicates.push_back(duplicateRef[node.primitivesOffset + i]);
+        }
+        while (padded.size() % 4 != 0) {
+            padded.push_back(nullptr);
+            if (!duplicateRef.empty())
+                paddedDuplicates.push_back(true);
+        }
+        node.primitivesOffset = offset;
+    }
+    primitives.swap(padded);
+    duplicateRef.swap(paddedDuplicates);
+    packs.assign(primitives.size() / 4, TrianglePack());
+    fillPacks();
+}
+
+void BVHAccel::fillPacks()
+{
+    for (int i = 0; i < (int)primitives.size(); ++i) {
+        TrianglePack &pack = packs[i / 4];
+        int lane = i % 4;
+        Vector3f v0, v1, v2;
+        if (primitives[i])
+            primitives[i]->getVertices(v0, v1, v2);
+        else
+            v0 = v1 = v2 = Vector3f(0.f);
+        Vector3f e1 = v1 - v0, e2 = v2 - v0;
+        for (int axis = 0; axis < 3; ++axis) {
+            pack.v0[axis][lane] = v0[axis];
+            pack.e1[axis][lane] = e1[axis];
+            pack.e2[axis][lane] = e2[axis];
+        }
+    }
+}
+
+// Moller-Trumbore against the four lanes of a pack, with the same culling and
+// arithmetic as Triangle::getIntersection. Returns the lane of the nearest hit
+// closer than tMax and updates tMax, u, v; -1 if no lane is hit.
+static int intersectPack(const TrianglePack &pack, const Ray &ray, float &tMax, float &u, float &v)
+{
+    alignas(16) float ts[4], us[4], vs[4];
+    int hitMask = 0;
+#if RAYTRACING_SSE
+    const __m128 dx = _mm_set1_ps(ray.direction.x), dy = _mm_set1_ps(ray.direction.y),
+                 dz = _mm_set1_ps(ray.direction.z);
+    const __m128 e1x = _mm_load_ps(pack.e1[0]), e1y = _mm_load_ps(pack.e1[1]),
+                 e1z = _mm_load_ps(pack.e1[2]);
+    const __m128 e2x = _mm_load_ps(pack.e2[0]), e2y = _mm_load_ps(pack.e2[1]),
+                 e2z = _mm_load_ps(pack.e2[2]);
+    const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.f);
+
+    __m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+    __m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+    __m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+    __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+    // back faces have a negative determinant
+    __m128 valid = _mm_cmpge_ps(det, _mm_set1_ps(kMinDeterminant));
+    __m128 detInv = _mm_div_ps(one, det);
+
+    __m128 tx = _mm_sub_ps(_mm_set1_ps(ray.origin.x), _mm_load_ps(pack.v0[0]));
+    __m128 ty = _mm_sub_ps(_mm_set1_ps(ray.origin.y), _mm_load_ps(pack.v0[1]));
+    __m128 tz = _mm_sub_ps(_mm_set1_ps(ray.origin.z), _mm_load_ps(pack.v0[2]));
+    __m128 uu = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, px), _mm_mul_ps(ty, py)), _mm_mul_ps(tz, pz)), detInv);
+    valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(uu, zero), _mm_cmple_ps(uu, one)));
+
+    __m128 qx = _mm_sub_ps(_mm_mul_ps(ty, e1z), _mm_mul_ps(tz, e1y));
+    __m128 qy = _mm_sub_ps(_mm_mul_ps(tz, e1x), _mm_mul_ps(tx, e1z));
+    __m128 qz = _mm_sub_ps(_mm_mul_ps(tx, e1y), _mm_mul_ps(ty, e1x));
+    __m128 vv = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), detInv);
+    valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(vv, zero), _mm_cmple_ps(_mm_add_ps(uu, vv), one)));
+
+    __m128 tt = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), detInv);
+    valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpgt_ps(tt, zero), _mm_cmplt_ps(tt, _mm_set1_ps(tMax))));
+
+    hitMask = _mm_movemask_ps(valid);
+    if (hitMask == 0)
+        return -1;
+    _mm_store_ps(ts, tt);
+    _mm_store_ps(us, uu);
+    _mm_store_ps(vs, vv);
+#else
+    for (int lane = 0; lane < 4; ++lane) {
+        Vector3f e1(pack.e1[0][lane], pack.e1[1][lane], pack.e1[2][lane]);
+        Vector3f e2(pack.e2[0][lane], pack.e2[1][lane], pack.e2[2][lane]);
+        Vector3f v0(pack.v0[0][lane], pack.v0[1][lane], pack.v0[2][lane]);
+        Vector3f pvec = crossProduct(ray.direction, e2);
+        float det = dotProduct(e1, pvec);
+        if (!(det >= kMinDeterminant))
+            continue;
+        float detInv = 1.f / det;
+        Vector3f tvec = ray.origin - v0;
+        us[lane] = dotProduct(tvec, pvec) * detInv;
+        if (us[lane] < 0 || us[lane] > 1)
+            continue;
+        Vector3f qvec = crossProduct(tvec, e1);
+        vs[lane] = dotProduct(ray.direction, qvec) * detInv;
+        if (vs[lane] < 0 || us[lane] + vs[lane] > 1)
+            continue;
+        ts[lane] = dotProduct(e2, qvec) * detInv;
+        if (ts[lane] > 0 && ts[lane] < tMax)
+            hitMask |= 1 << lane;
+    }
+    if (hitMask == 0)
+        return -1;
+#endif
+    int hitLane = -1;
+    for (int lane = 0; lane < 4; ++lane) {
+        if ((hitMask & (1 << lane)) && ts[lane] < tMax) {
+            tMax = ts[lane];
+            u = us[lane];
+            v = vs[lane];
+            hitLane = lane;
+        }
+    }
+    return hitLane;
+}
+
+// nearest hit found so far; packed leaves only record the triangle and
+// its barycentrics, the shading data is fetched once traversal is over
+struct TraversalHit {
     Intersection isect;
-    if (!root)
-        return isect;
-    isect = BVHAccel::getIntersection(root, ray);
-    return isect;
+    float tClosest = std::numeric_limits<float>::max();
+    Object* prim = nullptr;
+    float u = 0.f, v = 0.f;
+};
+
+void BVHAccel::intersectLeaf(int offset, int count, const Ray& ray, TraversalHit &hit) const
+{
+    if (packTriangles) {
+        for (int p = 0; p * 4 < count; ++p) {
+            int lane = intersectPack(packs[offset / 4 + p], ray, hit.tClosest, hit.u, hit.v);
+            if (lane >= 0)
+                hit.prim = primitives[offset + p * 4 + lane];
+        }
+        return;
+    }
+    for (int i = 0; i < count; ++i) {
+        Intersection isect = primitives[offset + i]->getIntersection(ray);
+        if (isect.happened && isect.distance < hit.tClosest) {
+            hit.isect = isect;
+            hit.tClosest = isect.distance;
+        }
+    }
+}
+
+bool BVHAccel::occludedLeaf(int offset, int count, const Ray& ray) const
+{
+    if (packTriangles) {
+        for (int p = 0; p * 4 < count; ++p) {
+            float tMax = ray.t_max, u, v;
+            if (intersectPack(packs[offset / 4 + p], ray, tMax, u, v) >= 0)
+                return true;
+        }
+        return false;
+    }
+    for (int i = 0; i < count; ++i)
+        if (primitives[offset + i]->intersect(ray))
+            return true;
+    return false;
 }
 
-Intersection BVHAccel::getIntersection(BVHBuildNode* node, const Ray& ray) const
+Intersection BVHAccel::Intersect(const Ray& ray) const
 {
-    // TODO Traverse the BVH to find intersection
+    if (nodes.empty())
+        return Intersection();
+    if (!wideNodes.empty())
+        return IntersectWide(ray);
     float x = ray.direction.x;
     float y = ray.direction.y;
     float z = ray.direction.z;
     Vector3f invDir = Vector3f(1.f/x,1.f/y,1.f/z);
-    std::array<int, 3> dirIsNeg = {int(x>0.f),int(y>0.f),int(z>0.f)};
-    bool isIntersected = node->bounds.IntersectP(ray, invDir, dirIsNeg);
-    if (!isIntersected) return Intersection();
-    // 如果节点是叶子节点
-    if (node->object) { // 要么左右子节点同时存在，要么同时不存在
-        return node->object->getIntersection(ray);
-    }
-    Intersection resLeft = getIntersection(node->left, ray);
-    Intersection resRight = getIntersection(node->right, ray);
-    if (resRight.distance > resLeft.distance) {
-        return resLeft;
-    } else {
-        return resRight;
+    // taken from invDir so zero components (+-inf) pick the matching slab
+    std::array<int, 3> dirIsNeg = {int(invDir.x>0.f),int(invDir.y>0.f),int(invDir.z>0.f)};
+
+    // far children wait on the stack with their entry distance, so they can
+    // be skipped once a closer hit is known
+    struct StackEntry { int node; float tEnter; };
+    StackEntry toVisit[maxTreeDepth];
+    int toVisitOffset = 0;
+    int currentNodeIndex = 0;
+    float tEnter;
+    TraversalHit hit;
+    if (!nodes[0].bounds.IntersectP(ray, invDir, dirIsNeg, hit.tClosest, tEnter))
+        return hit.isect;
+    while (true) {
+        const LinearBVHNode &node = nodes[currentNodeIndex];
+        int next = -1;
+        if (node.nPrimitives > 0) {
+            intersectLeaf(node.primitivesOffset, node.nPrimitives, ray, hit);
+        }
+        else {
+            int first = currentNodeIndex + 1, second = node.secondChildOffset;
+            float t0, t1;
+            bool hit0 = nodes[first].bounds.IntersectP(ray, invDir, dirIsNeg, hit.tClosest, t0);
+            bool hit1 = nodes[second].bounds.IntersectP(ray, invDir, dirIsNeg, hit.tClosest, t1);
+            if (hit0 && hit1) {
+                if (t1 < t0) {
+                    std::swap(first, second);
+                    std::swap(t0, t1);
+                }
+                toVisit[toVisitOffset++] = {second, t1};
+                next = first;
+            }
+            else if (hit0) next = first;
+            else if (hit1) next = second;
+        }
+        while (next < 0 && toVisitOffset > 0) {
+            const StackEntry &entry = toVisit[--toVisitOffset];
+            if (entry.tEnter <= hit.tClosest)
+                next = entry.node;
+        }
+        if (next < 0)
+            break;
+        currentNodeIndex = next;
     }
+    if (hit.prim)
+        return hit.prim->getIntersectionAt(ray, hit.tClosest, hit.u, hit.v);
+    return hit.isect;
 }
 
 
-void BVHAccel::getSample(BVHBuildNode* node, float p, Intersection &pos, float &pdf){
-    if(node->left == nullptr || node->right == nullptr){
-        node->object->Sample(pos, pdf);
-        pdf *= node->area;
+bool BVHAccel::IntersectP(const Ray& ray) const
+{
+    if (nodes.empty())
+        return false;
+    if (!wideNodes.empty())
+        return IntersectWideP(ray);
+    float x = ray.direction.x;
+    float y = ray.direction.y;
+    float z = ray.direction.z;
+    Vector3f invDir = Vector3f(1.f/x,1.f/y,1.f/z);
+    // taken from invDir so zero components (+-inf) pick the matching slab
+    std::array<int, 3> dirIsNeg = {int(invDir.x>0.f),int(invDir.y>0.f),int(invDir.z>0.f)};
+
+    // any hit closer than ray.t_max will do, so no ordering is needed
+    int toVisit[maxTreeDepth];
+    int toVisitOffset = 0;
+    int currentNodeIndex = 0;
+    float tEnter;
+    while (true) {
+        const LinearBVHNode &node = nodes[currentNodeIndex];
+        if (node.bounds.IntersectP(ray, invDir, dirIsNeg, ray.t_max, tEnter)) {
+            if (node.nPrimitives > 0) {
+                if (occludedLeaf(node.primitivesOffset, node.nPrimitives, ray))
+                    return true;
+            }
+            else {
+                toVisit[toVisitOffset++] = node.secondChildOffset;
+                currentNodeIndex = currentNodeIndex + 1;
+                continue;
+            }
+        }
+        if (toVisitOffset == 0)
+            break;
+        currentNodeIndex = toVisit[--toVisitOffset];
+    }
+    return false;
+}
+
+void BVHAccel::SetAccelerator(Accelerator accel)
+{
+    wideNodes.clear();
+    if (accel != Accelerator::BVH4 || nodes.empty())
+        return;
+    // a leaf root still gets one wide node so traversal has a single entry point
+    if (nodes[0].nPrimitives > 0) {
+        wideNodes.emplace_back();
+        WideBVHNode &node = wideNodes[0];
+        for (int i = 0; i < 4; ++i) {
+            node.child[i] = 0;
+            node.nPrimitives[i] = -1;
+        }
+        node.setChildBounds(0, nodes[0].bounds);
+        node.child[0] = nodes[0].primitivesOffset;
+        node.nPrimitives[0] = nodes[0].nPrimitives;
         return;
     }
-    if(p < node->left->area) getSample(node->left, p, pos, pdf);
-    else getSample(node->right, p - node->left->area, pos, pdf);
+    collapseToWide(0);
+}
+
+int BVHAccel::collapseToWide(int binaryIndex)
+{
+    int wideIndex = wideNodes.size();
+    wideNodes.emplace_back();
+
+    // open the interior child with the largest surface area until all four
+    // slots are filled or only leaves are left
+    int children[4];
+    int n = 0;
+    children[n++] = binaryIndex + 1;
+    children[n++] = nodes[binaryIndex].secondChildOffset;
+    while (n < 4) {
+        int best = -1;
+        float bestArea = -1.f;
+        for (int i = 0; i < n; ++i) {
+            const LinearBVHNode &child = nodes[children[i]];
+            if (child.nPrimitives == 0 && child.bounds.SurfaceArea() > bestArea) {
+                bestArea = child.bounds.SurfaceArea();
+                best = i;
+            }
+        }
+        if (best < 0)
+            break;
+        int opened = children[best];
+        children[best] = opened + 1;
+        children[n++] = nodes[opened].secondChildOffset;
+    }
+
+    for (int i = 0; i < 4; ++i) {
+        // recursion grows wideNodes, so only index it after the child is built
+        int child = -1, nPrims = -1;
+        Bounds3 bounds;
+        if (i < n) {
+            const LinearBVHNode &node = nodes[children[i]];
+            bounds = node.bounds;
+            if (node.nPrimitives > 0) {
+                child = node.primitivesOffset;
+                nPrims = node.nPrimitives;
+            }
+            else {
+                child = collapseToWide(children[i]);
+                nPrims = 0;
+            }
+        }
+        WideBVHNode &wide = wideNodes[wideIndex];
+        wide.setChildBounds(i, bounds);
+        wide.child[i] = child;
+        wide.nPrimitives[i] = nPrims;
+    }
+    return wideIndex;
+}
+
+void WideBVHNode::setChildBounds(int i, const Bounds3 &b)
+{
+    for (int axis = 0; axis < 3; ++axis) {
+        bounds[0][axis][i] = b.pMin[axis];
+        bounds[1][axis][i] = b.pMax[axis];
+    }
+}
+
+// slab test of the ray against the four child boxes of a wide node, same
+// acceptance rule as Bounds3::IntersectP; returns a bit per child hit and
+// each child's entry distance
+static int intersectWideNode(const WideBVHNode &node, const Ray &ray, const Vector3f &invDir,
+                             float tMax, float tEnter[4])
+{
+#if RAYTRACING_SSE
+    __m128 tNear = _mm_set1_ps(-std::numeric_limits<float>::max());
+    __m128 tFar = _mm_set1_ps(std::numeric_limits<float>::max());
+    for (int axis = 0; axis < 3; ++axis) {
+        __m128 o = _mm_set1_ps(ray.origin[axis]);
+        __m128 inv = _mm_set1_ps(invDir[axis]);
+        __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[0][axis]), o), inv);
+        __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[1][axis]), o), inv);
+        tNear = _mm_max_ps(tNear, _mm_min_ps(t0, t1));
+        tFar = _mm_min_ps(tFar, _mm_max_ps(t0, t1));
+    }
+    __m128 hit = _mm_and_ps(_mm_cmpge_ps(tFar, tNear), _mm_cmpgt_ps(tFar, _mm_setzero_ps()));
+    hit = _mm_and_ps(hit, _mm_cmple_ps(tNear, _mm_set1_ps(tMax)));
+    __m128i used = _mm_cmpgt_epi32(_mm_loadu_si128((const __m128i*)node.nPrimitives), _mm_set1_epi32(-1));
+    hit = _mm_and_ps(hit, _mm_castsi128_ps(used));
+    _mm_storeu_ps(tEnter, tNear);
+    return _mm_movemask_ps(hit);
+#else
+    int mask = 0;
+    for (int i = 0; i < 4; ++i) {
+        if (node.nPrimitives[i] < 0)
+            continue;
+        float tNear = -std::numeric_limits<float>::max();
+        float tFar = std::numeric_limits<float>::max();
+        for (int axis = 0; axis < 3; ++axis) {
+            float t0 = (node.bounds[0][axis][i] - ray.origin[axis]) * invDir[axis];
+            float t1 = (node.bounds[1][axis][i] - ray.origin[axis]) * invDir[axis];
+            tNear = std::max(tNear, std::min(t0, t1));
+            tFar = std::min(tFar, std::max(t0, t1));
+        }
+        tEnter[i] = tNear;
+        if (tFar >= tNear && tFar > 0 && tNear <= tMax)
+            mask |= 1 << i;
+    }
+    return mask;
+#endif
+}
+
+Intersection BVHAccel::IntersectWide(const Ray& ray) const
+{
+    Vector3f invDir = Vector3f(1.f/ray.direction.x, 1.f/ray.direction.y, 1.f/ray.direction.z);
+    // children are pushed farthest first so the nearest is popped next
+    struct StackEntry { int child, nPrimitives; float tEnter; };
+    StackEntry toVisit[256];
+    int toVisitOffset = 0;
+    toVisit[toVisitOffset++] = {0, 0, -std::numeric_limits<float>::max()};
+    TraversalHit hit;
+    while (toVisitOffset > 0) {
+        StackEntry entry = toVisit[--toVisitOffset];
+        if (entry.tEnter > hit.tClosest)
+            continue;
+        if (entry.nPrimitives > 0) {
+            intersectLeaf(entry.child, entry.nPrimitives, ray, hit);
+            continue;
+        }
+        const WideBVHNode &node = wideNodes[entry.child];
+        float tEnter[4];
+        int mask = intersectWideNode(node, ray, invDir, hit.tClosest, tEnter);
+        StackEntry hits[4];
+        int nHits = 0;
+        for (int i = 0; i < 4; ++i) {
+            if (!(mask & (1 << i)))
+                continue;
+            // insertion sort, nearest child last
+            int k = nHits++;
+            while (k > 0 && hits[k - 1].tEnter < tEnter[i]) {
+                hits[k] = hits[k - 1];
+                k--;
+            }
+            hits[k] = {node.child[i], node.nPrimitives[i], tEnter[i]};
+        }
+        for (int i = 0; i < nHits; ++i)
+            toVisit[toVisitOffset++] = hits[i];
+    }
+    if (hit.prim)
+        return hit.prim->getIntersectionAt(ray, hit.tClosest, hit.u, hit.v);
+    return hit.isect;
+}
+
+bool BVHAccel::IntersectWideP(const Ray& ray) const
+{
+    Vector3f invDir = Vector3f(1.f/ray.direction.x, 1.f/ray.direction.y, 1.f/ray.direction.z);
+    int toVisit[256];
+    int toVisitOffset = 0;
+    toVisit[toVisitOffset++] = 0;
+    while (toVisitOffset > 0) {
+        const WideBVHNode &node = wideNodes[toVisit[--toVisitOffset]];
+        float tEnter[4];
+        int mask = intersectWideNode(node, ray, invDir, ray.t_max, tEnter);
+        for (int i = 0; i < 4; ++i) {
+            if (!(mask & (1 << i)))
+                continue;
+            if (node.nPrimitives[i] == 0)
+                toVisit[toVisitOffset++] = node.child[i];
+            else if (occludedLeaf(node.child[i], node.nPrimitives[i], ray))
+                return true;
+        }
+    }
+    return false;
+}
+
+
+void BVHAccel::getSample(int nodeIndex, float p, Intersection &pos, float &pdf){
+    while (nodes[nodeIndex].nPrimitives == 0) {
+        int first = nodeIndex + 1;
+        if (p < nodeArea[first]) nodeIndex = first;
+        else {
+            p -= nodeArea[first];
+            nodeIndex = nodes[nodeIndex].secondChildOffset;
+        }
+    }
+    // pick a primitive of the leaf proportionally to its area
+    const LinearBVHNode &leaf = nodes[nodeIndex];
+    Object* object = primitives[leaf.primitivesOffset];
+    for (int i = 0; i < leaf.nPrimitives; ++i) {
+        if (refArea(leaf.primitivesOffset + i) == 0)
+            continue;
+        object = primitives[leaf.primitivesOffset + i];
+        if (p < object->getArea()) break;
+        p -= object->getArea();
+    }
+    object->Sample(pos, pdf);
+    pdf *= object->getArea();
 }
 
 void BVHAccel::Sample(Intersection &pos, float &pdf){
-    float p = std::sqrt(get_random_float()) * root->area;
-    getSample(root, p, pos, pdf);
-    pdf /= root->area;
-}
\ No newline at end of file
+    float p = get_random_float() * nodeArea[0];
+    getSample(0, p, pos, pdf);
+    pdf /= nodeArea[0];
+}
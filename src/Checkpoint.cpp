@@ -0,0 +1,71 @@
+#include <cstdio>
+#include <cstring>
+#include "Checkpoint.hpp"
+#include "MappedFile.hpp"
+
+static const char checkpointMagic[8] = {'R', 'T', 'C', 'K', 'P', 'T', '0', '1'};
+static const uint32_t checkpointVersion = 2;
+
+struct CheckpointPixel {
+    float radiance[3];
+    PixelStats stats;
+};
+
+bool WriteCheckpoint(const std::string &path, const CheckpointSettings &settings,
+                     const TiledFrameBuffer &radiance, const TiledBuffer<PixelStats> &stats)
+{
+    CheckpointHeader h;
+    memcpy(h.magic, checkpointMagic, sizeof(checkpointMagic));
+    h.version = checkpointVersion;
+    h.width = radiance.width;
+    h.height = radiance.height;
+    h.settings = settings;
+
+    std::string tmpPath = path + ".tmp";
+    FILE* fp = fopen(tmpPath.c_str(), "wb");
+    if (!fp)
+        return false;
+    bool ok = fwrite(&h, sizeof(h), 1, fp) == 1;
+    std::vector<CheckpointPixel> row(h.width);
+    for (int y = 0; y < h.height && ok; ++y) {
+        for (int x = 0; x < h.width; ++x) {
+            const Vector3f &L = radiance.at(x, y);
+            row[x] = {{L.x, L.y, L.z}, stats.at(x, y)};
+        }
+        ok = fwrite(row.data(), sizeof(CheckpointPixel), row.size(), fp) == row.size();
+    }
+    ok = fclose(fp) == 0 && ok;
+    // the last good checkpoint stays until the new one has been written out
+    if (!ok || !RenameReplacing(tmpPath, path)) {
+        remove(tmpPath.c_str());
+        return false;
+    }
+    return true;
+}
+
+CheckpointStatus ReadCheckpoint(const std::string &path, const CheckpointSettings &settings,
+                                TiledFrameBuffer &radiance, TiledBuffer<PixelStats> &stats)
+{
+    MappedFile file;
+    if (!file.open(path) || file.size() < sizeof(CheckpointHeader))
+        return CheckpointStatus::Missing;
+    CheckpointHeader h;
+    memcpy(&h, file.data(), sizeof(h));
+    if (memcmp(h.magic, checkpointMagic, sizeof(checkpointMagic)) != 0 || h.version != checkpointVersion)
+        return CheckpointStatus::Missing;
+    if (h.width != radiance.width || h.height != radiance.height || h.settings.samplerType != settings.samplerType ||
+        h.settings.spp != settings.spp || h.settings.seed != settings.seed)
+        return CheckpointStatus::Mismatch;
+    size_t expected = sizeof(h) + (size_t)radiance.width * radiance.height * sizeof(CheckpointPixel);
+    if (file.size() != expected)
+        return CheckpointStatus::Missing;
+    const char* p = file.data() + sizeof(h);
+    for (int y = 0; y < h.height; ++y)
+        for (int x = 0; x < h.width; ++x, p += sizeof(CheckpointPixel)) {
+            CheckpointPixel pixel;
+            memcpy(&pixel, p, sizeof(pixel));
+            radiance.at(x, y) = Vector3f(pixel.radiance[0], pixel.radiance[1], pixel.radiance[2]);
+            stats.at(x, y) = pixel.stats;
+        }
+    return CheckpointStatus::Loaded;
+}
@@ -0,0 +1,134 @@
+#include <algorithm>
+#include <cmath>
+#include <thread>
+#include "Denoiser.hpp"
+
+// run fn(y0, y1) over bands of rows on numThreads threads
+template <typename Fn>
+static void parallelRows(int height, int numThreads, Fn fn)
+{
+    int bands = std::max(1, std::min(numThreads, height));
+    std::vector<std::thread> threads;
+    for (int b = 0; b < bands; ++b)
+        threads.emplace_back(fn, height * b / bands, height * (b + 1) / bands);
+    for (auto& thread : threads)
+        thread.join();
+}
+
+// albedo is clamped away from zero so black surfaces survive the division
+static Vector3f albedoOf(const PixelFeatures &f)
+{
+    return Vector3f(std::max(f.albedo.x, 1e-3f), std::max(f.albedo.y, 1e-3f), std::max(f.albedo.z, 1e-3f));
+}
+
+std::vector<Vector3f> Denoiser::Filter(const std::vector<Vector3f> &image,
+                                       const std::vector<PixelFeatures> &features,
+                                       const std::vector<float> &variance,
+                                       int width, int height, int numThreads)
+{
+    static const float kernel[5] = {1 / 16.f, 1 / 4.f, 3 / 8.f, 1 / 4.f, 1 / 16.f};
+    static const float kernel3[3] = {1 / 4.f, 1 / 2.f, 1 / 4.f};
+    int n = width * height;
+    auto hit = [&](int i) { return features[i].depth > 0; };
+
+    // demodulated lighting, its variance and the screen space depth slopes
+    std::vector<Vector3f> color(n), nextColor(n);
+    std::vector<float> var(n), nextVar(n), dzdx(n), dzdy(n);
+    auto slope = [&](int i, int prev, int next, bool hasPrev, bool hasNext) {
+        hasPrev = hasPrev && hit(prev);
+        hasNext = hasNext && hit(next);
+        if (hasPrev && hasNext) return .5f * (features[next].depth - features[prev].depth);
+        if (hasNext) return features[next].depth - features[i].depth;
+        if (hasPrev) return features[i].depth - features[prev].depth;
+        return 0.f;
+    };
+    parallelRows(height, numThreads, [&](int y0, int y1) {
+        for (int y = y0; y < y1; ++y)
+            for (int x = 0; x < width; ++x) {
+                int i = y * width + x;
+                Vector3f a = albedoOf(features[i]);
+                color[i] = Vector3f(image[i].x / a.x, image[i].y / a.y, image[i].z / a.z);
+                float la = std::max(Luminance(a), 1e-3f);
+                var[i] = variance[i] >= 0 ? variance[i] / (la * la) : -1.f;
+                dzdx[i] = slope(i, i - 1, i + 1, x > 0, x + 1 < width);
+                dzdy[i] = slope(i, i - width, i + width, y > 0, y + 1 < height);
+            }
+    });
+    // pixels without a variance of their own take that of the lighting around them
+    parallelRows(height, numThreads, [&](int y0, int y1) {
+        for (int y = y0; y < y1; ++y)
+            for (int x = 0; x < width; ++x) {
+                int i = y * width + x;
+                if (var[i] >= 0 || !hit(i))
+                    continue;
+                PixelStats spread;
+                for (int qy = std::max(0, y - 2); qy <= std::min(height - 1, y + 2); ++qy)
+                    for (int qx = std::max(0, x - 2); qx <= std::min(width - 1, x + 2); ++qx)
+                        if (hit(qy * width + qx))
+                            spread.add(Luminance(color[qy * width + qx]));
+                var[i] = spread.n > 1 ? spread.m2 / (spread.n - 1) : 0.f;
+            }
+    });
+
+    for (int iteration = 0; iteration < iterations; ++iteration) {
+        int step = 1 << iteration;
+        parallelRows(height, numThreads, [&](int y0, int y1) {
+            for (int y = y0; y < y1; ++y)
+                for (int x = 0; x < width; ++x) {
+                    int i = y * width + x;
+                    if (!hit(i)) {
+                        nextColor[i] = color[i];
+                        nextVar[i] = var[i];
+                        continue;
+                    }
+                    // a 3x3 blur of the variance steadies the luminance test
+                    float blurred = 0, blurWeight = 0;
+                    for (int dy = -1; dy <= 1; ++dy)
+                        for (int dx = -1; dx <= 1; ++dx) {
+                            int qx = x + dx, qy = y + dy;
+                            if (qx < 0 || qx >= width || qy < 0 || qy >= height || var[qy * width + qx] < 0)
+                                continue;
+                            float k = kernel3[dx + 1] * kernel3[dy + 1];
+                            blurred += k * var[qy * width + qx];
+                            blurWeight += k;
+                        }
+                    float lumScale = sigmaLuminance * std::sqrt(blurred / blurWeight) + 1e-6f;
+                    float lp = Luminance(color[i]);
+                    const PixelFeatures& p = features[i];
+
+                    Vector3f sum(0.f);
+                    float sumWeight = 0, sumVar = 0;
+                    for (int dy = -2; dy <= 2; ++dy)
+                        for (int dx = -2; dx <= 2; ++dx) {
+                            int qx = x + dx * step, qy = y + dy * step;
+                            if (qx < 0 || qx >= width || qy < 0 || qy >= height)
+                                continue;
+                            int q = qy * width + qx;
+                            if (!hit(q))
+                                continue;
+                            float w = kernel[dx + 2] * kernel[dy + 2];
+                            if (q != i) {
+                                const PixelFeatures& f = features[q];
+                                float wn = std::pow(std::max(0.f, dotProduct(p.normal, f.normal)), sigmaNormal);
+                                float expected = std::fabs(dzdx[i] * dx + dzdy[i] * dy) * step;
+                                float wz = std::exp(-std::fabs(p.depth - f.depth) / (sigmaDepth * expected + 1e-2f));
+                                float wl = std::exp(-std::fabs(lp - Luminance(color[q])) / lumScale);
+                                w *= wn * wz * wl;
+                            }
+                            sum += w * color[q];
+                            sumVar += w * w * std::max(var[q], 0.f);
+                            sumWeight += w;
+                        }
+                    nextColor[i] = sum / sumWeight;
+                    nextVar[i] = sumVar / (sumWeight * sumWeight);
+                }
+        });
+        color.swap(nextColor);
+        var.swap(nextVar);
+    }
+
+    std::vector<Vector3f> result(n);
+    for (int i = 0; i < n; ++i)
+        result[i] = color[i] * albedoOf(features[i]);
+    return result;
+}
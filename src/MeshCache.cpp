@@ -0,0 +1,123 @@
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#include <functional>
+#include "MeshCache.hpp"
+
+static const char cacheMagic[8] = {'R', 'T', 'M', 'E', 'S', 'H', 'C', '1'};
+static const uint32_t cacheVersion = 2;
+
+static_assert(sizeof(Vector3f) == 3 * sizeof(float) && sizeof(Vector2f) == 2 * sizeof(float),
+              "vertices are written as plain floats");
+
+uint64_t HashBytes(const void* data, size_t size, uint64_t hash)
+{
+    const unsigned char* bytes = (const unsigned char*)data;
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+bool MeshCache::open(const std::string &path, uint64_t contentHash)
+{
+    close();
+    if (!file.open(path) || file.size() < sizeof(MeshCacheHeader))
+        return false;
+    const MeshCacheHeader* h = (const MeshCacheHeader*)file.data();
+    bool sane = h->nVertices <= file.size() && h->nTriangles <= file.size() &&
+                (h->nTexcoords == 0 || h->nTexcoords == h->nVertices);
+    uint64_t expected = sizeof(MeshCacheHeader) + h->nVertices * sizeof(Vector3f) +
+                        h->nTexcoords * sizeof(Vector2f) + h->nTriangles * 3 * sizeof(uint32_t) + h->bvhBytes;
+    if (memcmp(h->magic, cacheMagic, sizeof(cacheMagic)) != 0 || h->version != cacheVersion ||
+        h->contentHash != contentHash || !sane || expected != file.size()) {
+        close();
+        return false;
+    }
+    header = h;
+    // a corrupt index would send triangles outside the vertex buffer
+    const char* indices = section(2);
+    for (uint64_t i = 0; i < h->nTriangles * 3; ++i) {
+        uint32_t index;
+        memcpy(&index, indices + i * sizeof(uint32_t), sizeof(uint32_t));
+        if (index >= h->nVertices) {
+            close();
+            return false;
+        }
+    }
+    return true;
+}
+
+void MeshCache::close()
+{
+    file.close();
+    header = nullptr;
+}
+
+// start of the vertices, texture coordinates, indices and BVH blob
+const char* MeshCache::section(int i) const
+{
+    const char* p = file.data() + sizeof(MeshCacheHeader);
+    size_t sizes[] = {header->nVertices * sizeof(Vector3f), header->nTexcoords * sizeof(Vector2f),
+                      header->nTriangles * 3 * sizeof(uint32_t)};
+    for (int k = 0; k < i; ++k)
+        p += sizes[k];
+    return p;
+}
+
+void MeshCache::readVertices(Vector3f* vertices) const
+{
+    memcpy(vertices, section(0), header->nVertices * sizeof(Vector3f));
+}
+
+void MeshCache::readTexcoords(Vector2f* st) const
+{
+    memcpy(st, section(1), header->nTexcoords * sizeof(Vector2f));
+}
+
+void MeshCache::readIndices(uint32_t* indices) const
+{
+    memcpy(indices, section(2), header->nTriangles * 3 * sizeof(uint32_t));
+}
+
+const char* MeshCache::bvhData(uint64_t settingsHash, size_t &size) const
+{
+    if (!header || header->settingsHash != settingsHash || header->bvhBytes == 0)
+        return nullptr;
+    size = header->bvhBytes;
+    return section(3);
+}
+
+bool MeshCache::write(const std::string &path, uint64_t contentHash, uint64_t settingsHash,
+                      const Vector3f* vertices, const Vector2f* st, size_t nVertices,
+                      const uint32_t* indices, size_t nTriangles, const std::vector<char> &bvh)
+{
+    MeshCacheHeader h;
+    memcpy(h.magic, cacheMagic, sizeof(cacheMagic));
+    h.version = cacheVersion;
+    h.reserved = 0;
+    h.contentHash = contentHash;
+    h.settingsHash = settingsHash;
+    h.nVertices = nVertices;
+    h.nTexcoords = st ? nVertices : 0;
+    h.nTriangles = nTriangles;
+    h.bvhBytes = bvh.size();
+
+    std::string tmpPath = path + "." + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id())) + ".tmp";
+    FILE* fp = fopen(tmpPath.c_str(), "wb");
+    if (!fp)
+        return false;
+    bool ok = fwrite(&h, sizeof(h), 1, fp) == 1 &&
+              fwrite(vertices, sizeof(Vector3f), nVertices, fp) == nVertices &&
+              fwrite(st, sizeof(Vector2f), h.nTexcoords, fp) == h.nTexcoords &&
+              fwrite(indices, 3 * sizeof(uint32_t), nTriangles, fp) == nTriangles &&
+              fwrite(bvh.data(), 1, bvh.size(), fp) == bvh.size();
+    ok = fclose(fp) == 0 && ok;
+    // a failed write leaves the previous cache in place
+    if (!ok || !RenameReplacing(tmpPath, path)) {
+        remove(tmpPath.c_str());
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,297 @@
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include "ObjParser.hpp"
+
+namespace {
+
+// everything one chunk of the file declares; faces hold indices that are
+// either final or, for negative ones, relative to the chunk's first element
+struct ObjChunk {
+    std::vector<Vector3f> positions;
+    std::vector<Vector2f> texcoords;
+    std::vector<Vector3f> normals;
+    std::vector<int> positionIndices, texcoordIndices, normalIndices;
+    // corners whose index still needs the chunk's offset added
+    std::vector<int> relativePositions, relativeTexcoords, relativeNormals;
+    // parsing stops at the first bad line, counted from 1 within the chunk
+    bool ok = true;
+    std::string error;
+    int errorLine = 0;
+};
+
+inline bool isBlank(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+inline void skipBlanks(const char* &p, const char* end)
+{
+    while (p < end && isBlank(*p))
+        ++p;
+}
+
+// decimal float with optional sign, fraction and exponent. Up to 15
+// significant digits and 10^22 both the mantissa and the power of ten are
+// exact doubles, so their product or quotient is correctly rounded; the
+// conversion to float then rounds a second time and can be one ulp off
+// strtof in rare halfway cases. Longer numbers go through strtof. nan, inf
+// and values overflowing a float are rejected
+bool parseFloat(const char* &p, const char* end, float &value)
+{
+    skipBlanks(p, end);
+    const char* start = p;
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+'))
+        negative = *p++ == '-';
+    uint64_t mantissa = 0;
+    int digits = 0, exponent = 0;
+    bool any = false;
+    for (; p < end && *p >= '0' && *p <= '9'; ++p, any = true) {
+        if (digits < 19) {
+            mantissa = mantissa * 10 + (*p - '0');
+            if (mantissa) ++digits;
+        }
+        else {
+            ++exponent;
+        }
+    }
+    if (p < end && *p == '.') {
+        for (++p; p < end && *p >= '0' && *p <= '9'; ++p, any = true) {
+            if (digits < 19) {
+                mantissa = mantissa * 10 + (*p - '0');
+                if (mantissa) ++digits;
+                --exponent;
+            }
+        }
+    }
+    if (!any)
+        return false;
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        const char* q = p + 1;
+        bool negExp = false;
+        if (q < end && (*q == '-' || *q == '+'))
+            negExp = *q++ == '-';
+        if (q < end && *q >= '0' && *q <= '9') {
+            int e = 0;
+            for (; q < end && *q >= '0' && *q <= '9'; ++q)
+                e = std::min(e * 10 + (*q - '0'), 100000);
+            exponent += negExp ? -e : e;
+            p = q;
+        }
+    }
+    static const double powers[] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,
+                                    1e8,  1e9,  1e10, 1e11, 1e12, 1e13, 1e14, 1e15,
+                                    1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+    if (digits <= 15 && exponent >= -22 && exponent <= 22) {
+        double d = (double)mantissa;
+        d = exponent < 0 ? d / powers[-exponent] : d * powers[exponent];
+        value = float(negative ? -d : d);
+        return std::isfinite(value);
+    }
+    char buffer[128];
+    size_t length = std::min<size_t>(p - start, sizeof(buffer) - 1);
+    memcpy(buffer, start, length);
+    buffer[length] = '\0';
+    value = strtof(buffer, nullptr);
+    return std::isfinite(value);
+}
+
+bool parseInt(const char* &p, const char* end, int &value)
+{
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+'))
+        negative = *p++ == '-';
+    if (p >= end || *p < '0' || *p > '9')
+        return false;
+    long long v = 0;
+    for (; p < end && *p >= '0' && *p <= '9'; ++p)
+        v = std::min(v * 10 + (*p - '0'), (long long)INT32_MAX);
+    value = int(negative ? -v : v);
+    return true;
+}
+
+// OBJ indices are 1-based, negative ones count back from the latest element;
+// 0 never gets here
+inline int resolveIndex(int index, int count, std::vector<int> &relative, int corner)
+{
+    if (index >= 0)
+        return index - 1;
+    relative.push_back(corner);
+    return count + index;
+}
+
+void parseChunk(const char* p, const char* end, ObjChunk &chunk)
+{
+    // corners of the current face, as (position, texcoord, normal)
+    std::vector<std::array<int, 3>> face;
+    // a dropped vertex would shift every index after it, so a bad one fails
+    auto fail = [&](const char* what, int line) {
+        chunk.ok = false;
+        chunk.error = what;
+        chunk.errorLine = line;
+    };
+    for (int line = 1; p < end; ++line) {
+        const char* lineEnd = (const char*)memchr(p, '\n', end - p);
+        if (!lineEnd)
+            lineEnd = end;
+        skipBlanks(p, lineEnd);
+        if (p + 1 < lineEnd && p[0] == 'v' && isBlank(p[1])) {
+            Vector3f v;
+            p += 1;
+            if (!parseFloat(p, lineEnd, v.x) || !parseFloat(p, lineEnd, v.y) || !parseFloat(p, lineEnd, v.z))
+                return fail("bad vertex position", line);
+            chunk.positions.push_back(v);
+        }
+        else if (p + 2 < lineEnd && p[0] == 'v' && p[1] == 't' && isBlank(p[2])) {
+            Vector2f t;
+            p += 2;
+            if (!parseFloat(p, lineEnd, t.x))
+                return fail("bad texture coordinate", line);
+            // the second coordinate is optional
+            skipBlanks(p, lineEnd);
+            t.y = 0;
+            if (p < lineEnd && !parseFloat(p, lineEnd, t.y))
+                return fail("bad texture coordinate", line);
+            chunk.texcoords.push_back(t);
+        }
+        else if (p + 2 < lineEnd && p[0] == 'v' && p[1] == 'n' && isBlank(p[2])) {
+            Vector3f n;
+            p += 2;
+            if (!parseFloat(p, lineEnd, n.x) || !parseFloat(p, lineEnd, n.y) || !parseFloat(p, lineEnd, n.z))
+                return fail("bad vertex normal", line);
+            chunk.normals.push_back(n);
+        }
+        else if (p + 1 < lineEnd && p[0] == 'f' && isBlank(p[1])) {
+            p += 1;
+            face.clear();
+            while (true) {
+                skipBlanks(p, lineEnd);
+                if (p == lineEnd || *p == '#')
+                    break;
+                // v, v/vt, v//vn or v/vt/vn; 0 marks a slot left out, so
+                // an explicit 0 is rejected along with any other bad token
+                int indices[3] = {0, 0, 0};
+                bool ok = parseInt(p, lineEnd, indices[0]) && indices[0] != 0;
+                for (int k = 1; ok && k < 3 && p < lineEnd && *p == '/'; ++k) {
+                    ++p;
+                    if (k == 1 && p < lineEnd && *p == '/')
+                        continue;
+                    ok = parseInt(p, lineEnd, indices[k]) && indices[k] != 0;
+                }
+                if (!ok || (p < lineEnd && !isBlank(*p)))
+                    return fail("bad face corner", line);
+                face.push_back({{indices[0], indices[1], indices[2]}});
+            }
+            if (face.size() < 3)
+                return fail("face with fewer than three corners", line);
+            // fan around the first corner
+            for (int i = 1; i + 1 < (int)face.size(); ++i) {
+                for (int corner : {0, i, i + 1}) {
+                    int slot = chunk.positionIndices.size();
+                    const std::array<int, 3> &c = face[corner];
+                    chunk.positionIndices.push_back(
+                        resolveIndex(c[0], chunk.positions.size(), chunk.relativePositions, slot));
+                    chunk.texcoordIndices.push_back(
+                        c[1] ? resolveIndex(c[1], chunk.texcoords.size(), chunk.relativeTexcoords, slot) : -1);
+                    chunk.normalIndices.push_back(
+                        c[2] ? resolveIndex(c[2], chunk.normals.size(), chunk.relativeNormals, slot) : -1);
+                }
+            }
+        }
+        p = lineEnd + 1;
+    }
+}
+
+template <typename T>
+void appendAt(std::vector<T> &dst, size_t offset, const std::vector<T> &src)
+{
+    std::copy(src.begin(), src.end(), dst.begin() + offset);
+}
+
+} // namespace
+
+bool ParseObj(const char* data, size_t size, ObjMesh &mesh, std::string* error)
+{
+    mesh = ObjMesh();
+    // chunks of at least 1 MB, cut after a newline
+    const size_t minChunk = 1 << 20;
+    int nChunks = std::max<size_t>(1, std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()),
+                                                      size / minChunk));
+    std::vector<const char*> bounds(nChunks + 1);
+    bounds[0] = data;
+    bounds[nChunks] = data + size;
+    for (int i = 1; i < nChunks; ++i) {
+        const char* p = std::max(bounds[i - 1], data + size * i / nChunks);
+        const char* nl = (const char*)memchr(p, '\n', data + size - p);
+        bounds[i] = nl ? nl + 1 : data + size;
+    }
+
+    std::vector<ObjChunk> chunks(nChunks);
+    auto forEachChunk = [&](auto fn) {
+        std::vector<std::thread> workers;
+        for (int i = 1; i < nChunks; ++i)
+            workers.emplace_back(fn, i);
+        fn(0);
+        for (auto &w : workers)
+            w.join();
+    };
+    forEachChunk([&](int i) { parseChunk(bounds[i], bounds[i + 1], chunks[i]); });
+    for (int i = 0; i < nChunks; ++i) {
+        if (chunks[i].ok)
+            continue;
+        if (error) {
+            size_t line = std::count(data, bounds[i], '\n') + chunks[i].errorLine;
+            *error = "line " + std::to_string(line) + ": " + chunks[i].error;
+        }
+        mesh = ObjMesh();
+        return false;
+    }
+
+    // every chunk's elements and corners follow those of the chunks before it
+    std::vector<size_t> posOffset(nChunks + 1, 0), texOffset(nChunks + 1, 0),
+        normOffset(nChunks + 1, 0), cornerOffset(nChunks + 1, 0);
+    for (int i = 0; i < nChunks; ++i) {
+        posOffset[i + 1] = posOffset[i] + chunks[i].positions.size();
+        texOffset[i + 1] = texOffset[i] + chunks[i].texcoords.size();
+        normOffset[i + 1] = normOffset[i] + chunks[i].normals.size();
+        cornerOffset[i + 1] = cornerOffset[i] + chunks[i].positionIndices.size();
+    }
+    mesh.positions.resize(posOffset[nChunks]);
+    mesh.texcoords.resize(texOffset[nChunks]);
+    mesh.normals.resize(normOffset[nChunks]);
+    mesh.positionIndices.resize(cornerOffset[nChunks]);
+    mesh.texcoordIndices.resize(cornerOffset[nChunks]);
+    mesh.normalIndices.resize(cornerOffset[nChunks]);
+    forEachChunk([&](int i) {
+        ObjChunk &chunk = chunks[i];
+        for (int corner : chunk.relativePositions)
+            chunk.positionIndices[corner] += posOffset[i];
+        for (int corner : chunk.relativeTexcoords)
+            chunk.texcoordIndices[corner] += texOffset[i];
+        for (int corner : chunk.relativeNormals)
+            chunk.normalIndices[corner] += normOffset[i];
+        appendAt(mesh.positions, posOffset[i], chunk.positions);
+        appendAt(mesh.texcoords, texOffset[i], chunk.texcoords);
+        appendAt(mesh.normals, normOffset[i], chunk.normals);
+        appendAt(mesh.positionIndices, cornerOffset[i], chunk.positionIndices);
+        appendAt(mesh.texcoordIndices, cornerOffset[i], chunk.texcoordIndices);
+        appendAt(mesh.normalIndices, cornerOffset[i], chunk.normalIndices);
+        chunk = ObjChunk();
+    });
+
+    auto inRange = [](const std::vector<int> &indices, size_t count, bool optional) {
+        return std::all_of(indices.begin(), indices.end(), [&](int i) {
+            return (optional && i == -1) || (i >= 0 && (size_t)i < count);
+        });
+    };
+    if (!inRange(mesh.positionIndices, mesh.positions.size(), false) ||
+        !inRange(mesh.texcoordIndices, mesh.texcoords.size(), true) ||
+        !inRange(mesh.normalIndices, mesh.normals.size(), true)) {
+        if (error)
+            *error = "face index out of range";
+        mesh = ObjMesh();
+        return false;
+    }
+    return true;
+}
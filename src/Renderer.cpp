@@ -4,12 +4,17 @@
 #include "Scene.hpp"
 #include "Renderer.hpp"
 #include <thread>
-#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include "Checkpoint.hpp"
+#include "Denoiser.hpp"
+#include "FrameBuffer.hpp"
+#include "TileScheduler.hpp"
 
 inline float deg2rad(const float& deg) { return deg * M_PI / 180.f; }
 
 const float EPSILON = 0.00001f;
-std::mutex framebufferMutex;
 
 // The main render function. This where we iterate over all pixels in the image,
 // generate primary rays and cast these rays into the scene. The content of the
@@ -25,6 +30,7 @@ void Renderer::Render(const Scene& scene, int rt_spp)
     // change the spp value to change sample ammount
     int spp = rt_spp;
     std::cout << "SPP: " << spp << "\n";
+    Sampler::samplesPerPixel = spp;
     
     for (int j = 0; j < scene.height; ++j) {
         for (int i = 0; i < scene.width; ++i) {
@@ -35,6 +41,7 @@ void Renderer::Render(const Scene& scene, int rt_spp)
 
             Vector3f dir = normalize(Vector3f(-x, y, 1.f));
             for (int k = 0; k < spp; k++){
+                StartPixelSample(m, k);
                 framebuffer[m] += scene.castRay(Ray(eye_pos, dir), 0) / (spp*1.f);  
             }
             m++;
@@ -57,72 +64,295 @@ void Renderer::Render(const Scene& scene, int rt_spp)
 }
 
 
-void Renderer::RenderMultiThread(const Scene& scene, int rt_spp)
+// Run fn(worker, tile) over every tile of the image on num_threads threads
+// and show progress until the last one is done.
+template <typename Fn>
+static void forEachTile(const Scene& scene, const RenderOptions& options, int num_threads, Fn fn)
 {
-    float scale = tan(deg2rad(scene.fov * 0.5f));
-    float imageAspectRatio = scene.width / (float)scene.height;
-    Vector3f eye_pos(278, 273, -800);
-
-    std::vector<Vector3f> framebuffer(scene.width * scene.height);
-    int spp = rt_spp;
-    std::cout << "SPP: " << spp << "\n";
-    int num_threads = 16;
+    TileScheduler scheduler(scene.width, scene.height, options.tileSize, num_threads);
+    std::atomic<int> tiles_done(0);
     std::vector<std::thread> threads;
-    int line_group_num = scene.height / num_threads;
 
     for (int thr = 0; thr < num_threads; ++thr) {
-        int j_start = thr * line_group_num;
         // multi thread render
-        threads.push_back(std::thread([&](int j_begin){
-            int m = j_begin * scene.width;
-            int j_end = j_begin + line_group_num;
-            for (int j = j_begin; j < j_end; ++j) {
-                for (int i = 0; i < scene.width; ++i) {
-                    // generate primary ray direction
-                    float x = (2.f * (i + 0.5f) / (float)scene.width - 1) *
-                                imageAspectRatio * scale;
-                    float y = (1.f - 2 * (j + 0.5f) / (float)scene.height) * scale;
-
-                    Vector3f dir = normalize(Vector3f(-x, y, 1));
-                    Vector3f res_col(0);
-                    for (int k = 0; k < spp; k++){
-                        res_col += scene.castRay(Ray(eye_pos, dir), 0);
-                    }
-                    // for (int k = 0; k < spp; k++){
-                    //     res_col += scene.castRayDiff(Ray(eye_pos, dir), 0);
-                    // }
-                    framebufferMutex.lock();
-                    framebuffer[m] = res_col / (spp*1.f);
-                    framebufferMutex.unlock();  
-                    m++;
-                }
+        threads.push_back(std::thread([&](int worker){
+            Tile tile;
+            while (scheduler.next(worker, tile)) {
+                fn(worker, tile);
+                tiles_done++;
             }
-        }, j_start));
+        }, thr));
+    }
+    while (tiles_done < scheduler.tileCount()) {
+        UpdateProgress(tiles_done / (float)scheduler.tileCount());
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
     }
-    std::cout << "waiting for thread end: " << spp << std::endl;
     for (int thr = 0; thr < num_threads; ++thr) {
         threads[thr].join();
-        UpdateProgress(thr / (float)num_threads);
     }
     UpdateProgress(1.f);
+}
+
+// radiance divided by each pixel's own sample count
+static std::vector<Vector3f> averagedImage(const TiledFrameBuffer& framebuffer, const TiledBuffer<PixelStats>& stats)
+{
+    std::vector<Vector3f> image = framebuffer.resolve(1.f);
+    for (int j = 0; j < framebuffer.height; ++j)
+        for (int i = 0; i < framebuffer.width; ++i)
+            image[j * framebuffer.width + i] = image[j * framebuffer.width + i] / (float)std::max(stats.at(i, j).n, 1u);
+    return image;
+}
 
-    std::string img_file_name = "./build/SPP" + std::to_string(spp) + ".ppm";
+static void writeImage(const std::string& img_file_name, const std::vector<Vector3f>& image, int width, int height)
+{
     const char* img_const_name = img_file_name.c_str();
-    std::cout << img_const_name << std::endl;
-    std::cout << "writing to file " << img_const_name << ": " << spp << std::endl;
     FILE* fp = fopen(img_const_name, "wb");
-    (void)fprintf(fp, "P6\n%d %d\n255\n", scene.width, scene.height);
-    int num_pixels = scene.height * scene.width;
+    (void)fprintf(fp, "P6\n%d %d\n255\n", width, height);
+    int num_pixels = height * width;
     for (auto i = 0; i < num_pixels; ++i) {
         static unsigned char color[3];
-        color[0] = (unsigned char)(255 * std::pow(clamp(0, 1, framebuffer[i].x), 0.6f));
-        color[1] = (unsigned char)(255 * std::pow(clamp(0, 1, framebuffer[i].y), 0.6f));
-        color[2] = (unsigned char)(255 * std::pow(clamp(0, 1, framebuffer[i].z), 0.6f));
+        color[0] = (unsigned char)(255 * std::pow(clamp(0, 1, image[i].x), 0.6f));
+        color[1] = (unsigned char)(255 * std::pow(clamp(0, 1, image[i].y), 0.6f));
+        color[2] = (unsigned char)(255 * std::pow(clamp(0, 1, image[i].z), 0.6f));
         fwrite(color, 1, 3, fp);
-        if (i % scene.width == 0) {
+        if (i % width == 0) {
             UpdateProgress((float)i / num_pixels);
         }
     }
     UpdateProgress(1.f);
     fclose(fp);
 }
+
+// linear floats, rows bottom to top, the negative scale marks little endian
+static void writePfm(const std::string& path, const std::vector<float>& data, int channels, int width, int height)
+{
+    FILE* fp = fopen(path.c_str(), "wb");
+    if (!fp) {
+        printf(" - could not write %s\n", path.c_str());
+        return;
+    }
+    (void)fprintf(fp, "%s\n%d %d\n-1.0\n", channels == 3 ? "PF" : "Pf", width, height);
+    for (int y = height - 1; y >= 0; --y)
+        fwrite(&data[(size_t)y * width * channels], sizeof(float), (size_t)width * channels, fp);
+    fclose(fp);
+}
+
+static void writeAovs(const std::string& base, const std::vector<PixelFeatures>& features,
+                      const std::vector<float>& variance, int width, int height)
+{
+    size_t num_pixels = (size_t)width * height;
+    std::vector<float> albedo(3 * num_pixels), normal(3 * num_pixels), depth(num_pixels), var(num_pixels);
+    for (size_t i = 0; i < num_pixels; ++i) {
+        const PixelFeatures& f = features[i];
+        for (int c = 0; c < 3; ++c) {
+            albedo[3 * i + c] = f.albedo[c];
+            normal[3 * i + c] = f.normal[c];
+        }
+        depth[i] = f.depth;
+        var[i] = std::max(variance[i], 0.f);
+    }
+    writePfm(base + "_albedo.pfm", albedo, 3, width, height);
+    writePfm(base + "_normal.pfm", normal, 3, width, height);
+    writePfm(base + "_depth.pfm", depth, 1, width, height);
+    writePfm(base + "_variance.pfm", var, 1, width, height);
+    printf(" - AOVs written to %s_{albedo,normal,depth,variance}.pfm\n", base.c_str());
+}
+
+// set from a signal handler, a progressive render stops at the next tile;
+// the workers read it too, so it must be an atomic and lock-free to be
+// safe in the handler
+static std::atomic<bool> stopRequested(false);
+static_assert(std::atomic<bool>::is_always_lock_free, "signal handlers may only touch lock-free atomics");
+extern "C" void requestStop(int) { stopRequested = true; }
+
+bool Renderer::RenderMultiThread(const Scene& scene, const RenderOptions& options)
+{
+    float scale = tan(deg2rad(scene.fov * 0.5f));
+    float imageAspectRatio = scene.width / (float)scene.height;
+    Vector3f eye_pos(278, 273, -800);
+    // camera ray through the image point (px, py), pixel (i, j) covering
+    // [i, i + 1) x [j, j + 1)
+    auto primaryRay = [&](float px, float py) {
+        // generate primary ray direction
+        float x = (2.f * px / (float)scene.width - 1) *
+                    imageAspectRatio * scale;
+        float y = (1.f - 2 * py / (float)scene.height) * scale;
+        return Ray(eye_pos, normalize(Vector3f(-x, y, 1)));
+    };
+
+    TiledFrameBuffer framebuffer(scene.width, scene.height, options.tileSize);
+    int spp = options.spp;
+    std::cout << "SPP: " << spp << "\n";
+    Sampler::samplesPerPixel = spp;
+    int num_threads = options.numThreads > 0 ? options.numThreads
+                                             : std::max(1u, std::thread::hardware_concurrency());
+    int tile_size = std::max(1, options.tileSize);
+    int num_tiles = ((scene.width + tile_size - 1) / tile_size) * ((scene.height + tile_size - 1) / tile_size);
+    std::cout << "threads: " << num_threads << ", tiles: " << num_tiles << "\n";
+    std::vector<Vector3f> image;
+
+    std::string img_base = "./build/SPP" + std::to_string(spp);
+    std::string img_file_name = img_base + ".ppm";
+    bool adaptive = options.adaptiveError > 0;
+    bool progressive = !options.checkpointPath.empty();
+    // first-hit features and the variance of every pixel, row-major
+    bool wantFeatures = options.writeAovs || options.denoise;
+    std::vector<PixelFeatures> features;
+    std::vector<float> variance;
+    if (wantFeatures) {
+        features.resize(scene.width * scene.height);
+        variance.resize(scene.width * scene.height);
+    }
+
+    if (!adaptive && !progressive) {
+        std::cout << "waiting for thread end: " << spp << std::endl;
+        forEachTile(scene, options, num_threads, [&](int, const Tile& tile) {
+            for (int j = tile.y0; j < tile.y1; ++j) {
+                for (int i = tile.x0; i < tile.x1; ++i) {
+                    Vector3f res_col(0);
+                    PixelStats pixel;
+                    for (int k = 0; k < spp; k++){
+                        // the sampler's first 2D point places the camera ray in the pixel
+                        StartPixelSample(j * scene.width + i, k, options.seed);
+                        Vector2f offset = get_random_float2();
+                        Vector3f L = scene.castRay(primaryRay(i + offset.x, j + offset.y), 0);
+                        res_col += L;
+                        if (wantFeatures)
+                            pixel.add(Luminance(L));
+                    }
+                    if (wantFeatures) {
+                        // features are those seen through the pixel centre
+                        Intersection centreHit = scene.intersect(primaryRay(i + 0.5f, j + 0.5f));
+                        features[j * scene.width + i] = scene.firstHitFeatures(centreHit);
+                        variance[j * scene.width + i] = pixel.meanVariance();
+                    }
+                    // for (int k = 0; k < spp; k++){
+                    //     res_col += scene.castRayDiff(Ray(eye_pos, dir), 0);
+                    // }
+                    framebuffer.at(i, j) += res_col;
+                }
+            }
+        });
+        image = framebuffer.resolve(1.f / spp);
+    }
+    else {
+        // every pass gives each pixel that is still active up to minSpp more
+        // samples, until all have spp or, when adaptive, reached the target
+        TiledBuffer<PixelStats> stats(scene.width, scene.height, options.tileSize);
+        int batch = std::max(adaptive ? 2 : 1, std::min(options.minSpp, spp));
+        const std::string& checkpoint = options.checkpointPath;
+        CheckpointSettings settings = {(uint32_t)Sampler::defaultType, (uint32_t)spp, options.seed};
+        if (progressive && options.resume) {
+            CheckpointStatus status = ReadCheckpoint(checkpoint, settings, framebuffer, stats);
+            if (status == CheckpointStatus::Mismatch) {
+                // starting over would overwrite samples the user may still want
+                printf(" - %s was written for another image size, sampler, spp or seed, not resuming\n",
+                       checkpoint.c_str());
+                return false;
+            }
+            if (status == CheckpointStatus::Loaded)
+                printf(" - resuming from %s\n", checkpoint.c_str());
+            else
+                printf(" - no usable checkpoint in %s, starting over\n", checkpoint.c_str());
+        }
+        auto saveProgress = [&]() {
+            if (!WriteCheckpoint(checkpoint, settings, framebuffer, stats))
+                printf(" - could not write %s\n", checkpoint.c_str());
+            writeImage(img_file_name, averagedImage(framebuffer, stats), scene.width, scene.height);
+        };
+        void (*previousInt)(int) = SIG_DFL, (*previousTerm)(int) = SIG_DFL;
+        if (progressive) {
+            stopRequested = false;
+            previousInt = std::signal(SIGINT, requestStop);
+            previousTerm = std::signal(SIGTERM, requestStop);
+        }
+
+        // pixels come back in every pass, so the hits of rays through their
+        // centres are traced once up front into a G-buffer; unlike the single
+        // pass, samples here are not jittered within the pixel
+        TiledBuffer<Intersection> gbuffer(scene.width, scene.height, options.tileSize);
+        forEachTile(scene, options, num_threads, [&](int, const Tile& tile) {
+            for (int j = tile.y0; j < tile.y1; ++j)
+                for (int i = tile.x0; i < tile.x1; ++i) {
+                    gbuffer.at(i, j) = scene.intersect(primaryRay(i + 0.5f, j + 0.5f));
+                    if (wantFeatures)
+                        features[j * scene.width + i] = scene.firstHitFeatures(gbuffer.at(i, j));
+                }
+        });
+
+        auto lastCheckpoint = std::chrono::steady_clock::now();
+        for (int pass = 1;; ++pass) {
+            std::atomic<int> active(0);
+            forEachTile(scene, options, num_threads, [&](int, const Tile& tile) {
+                if (stopRequested)
+                    return;
+                int tileActive = 0;
+                for (int j = tile.y0; j < tile.y1; ++j) {
+                    for (int i = tile.x0; i < tile.x1; ++i) {
+                        PixelStats& pixel = stats.at(i, j);
+                        if (pixel.n >= (uint32_t)spp ||
+                            (adaptive && pixel.n >= (uint32_t)batch &&
+                             pixel.relativeError() <= options.adaptiveError))
+                            continue;
+                        tileActive++;
+                        Ray ray = primaryRay(i + 0.5f, j + 0.5f);
+                        Vector3f res_col(0);
+                        uint32_t end = std::min<uint32_t>(pixel.n + batch, spp);
+                        for (uint32_t k = pixel.n; k < end; k++) {
+                            StartPixelSample(j * scene.width + i, k, options.seed);
+                            Vector3f L = scene.castRay(ray, gbuffer.at(i, j));
+                            res_col += L;
+                            pixel.add(Luminance(L));
+                        }
+                        framebuffer.at(i, j) += res_col;
+                    }
+                }
+                active += tileActive;
+            });
+            if (active == 0 || stopRequested)
+                break;
+            printf("\n - pass %d: %d pixels sampled\n", pass, active.load());
+            auto now = std::chrono::steady_clock::now();
+            if (progressive && std::chrono::duration<float>(now - lastCheckpoint).count() >= options.checkpointInterval) {
+                saveProgress();
+                printf("\n - checkpoint written to %s\n", checkpoint.c_str());
+                lastCheckpoint = now;
+            }
+        }
+        if (progressive) {
+            std::signal(SIGINT, previousInt);
+            std::signal(SIGTERM, previousTerm);
+            if (stopRequested)
+                printf("\n - interrupted, resume with --checkpoint %s --resume\n", checkpoint.c_str());
+            if (!WriteCheckpoint(checkpoint, settings, framebuffer, stats))
+                printf(" - could not write %s\n", checkpoint.c_str());
+        }
+        image = averagedImage(framebuffer, stats);
+        uint64_t samples = 0;
+        for (int j = 0; j < scene.height; ++j)
+            for (int i = 0; i < scene.width; ++i) {
+                samples += stats.at(i, j).n;
+                if (wantFeatures)
+                    variance[j * scene.width + i] = stats.at(i, j).meanVariance();
+            }
+        int num_pixels = scene.width * scene.height;
+        printf("\n - %.1f samples per pixel on average, %.0f%% of %d\n",
+               samples / (double)num_pixels, 100.0 * samples / ((double)num_pixels * spp), spp);
+    }
+
+    std::cout << img_file_name << std::endl;
+    std::cout << "writing to file " << img_file_name << ": " << spp << std::endl;
+    writeImage(img_file_name, image, scene.width, scene.height);
+
+    if (options.writeAovs)
+        writeAovs(img_base, features, variance, scene.width, scene.height);
+    if (options.denoise) {
+        auto start = std::chrono::steady_clock::now();
+        std::vector<Vector3f> denoised = Denoiser::Filter(image, features, variance,
+                                                          scene.width, scene.height, num_threads);
+        auto stop = std::chrono::steady_clock::now();
+        printf("\n - denoised in %.0f ms\n", std::chrono::duration<double, std::milli>(stop - start).count());
+        writeImage(img_base + "_denoised.ppm", denoised, scene.width, scene.height);
+    }
+    return true;
+}
@@ -0,0 +1,245 @@
+#include <cmath>
+#include "Sampler.hpp"
+
+namespace {
+
+inline uint64_t Hash(uint64_t a, uint64_t b) { return MixBits(a ^ MixBits(b + 0x9e3779b97f4a7c15ULL)); }
+
+inline float ToUnitFloat(uint32_t bits) { return std::min(0x1.fffffep-1f, bits * 0x1p-32f); }
+
+inline uint32_t ReverseBits(uint32_t v)
+{
+    v = (v << 16) | (v >> 16);
+    v = ((v & 0x00ff00ffu) << 8) | ((v & 0xff00ff00u) >> 8);
+    v = ((v & 0x0f0f0f0fu) << 4) | ((v & 0xf0f0f0f0u) >> 4);
+    v = ((v & 0x33333333u) << 2) | ((v & 0xccccccccu) >> 2);
+    v = ((v & 0x55555555u) << 1) | ((v & 0xaaaaaaaau) >> 1);
+    return v;
+}
+
+// element i of a random permutation of [0, n) chosen by p, without
+// storing it (Kensler, "Correlated Multi-Jittered Sampling")
+uint32_t PermutationElement(uint32_t i, uint32_t n, uint32_t p)
+{
+    uint32_t w = n - 1;
+    w |= w >> 1;
+    w |= w >> 2;
+    w |= w >> 4;
+    w |= w >> 8;
+    w |= w >> 16;
+    do {
+        i ^= p;
+        i *= 0xe170893d;
+        i ^= p >> 16;
+        i ^= (i & w) >> 4;
+        i ^= p >> 8;
+        i *= 0x0929eb3f;
+        i ^= p >> 23;
+        i ^= (i & w) >> 1;
+        i *= 1 | p >> 27;
+        i *= 0x6935fa69;
+        i ^= (i & w) >> 11;
+        i *= 0x74dcb303;
+        i ^= (i & w) >> 2;
+        i *= 0x9e501cc3;
+        i ^= (i & w) >> 2;
+        i *= 0xc860a3df;
+        i &= w;
+        i ^= i >> 5;
+    } while (i >= n);
+    return (i + p) % n;
+}
+
+// nested uniform (Owen) scrambling of the bits of v in hash form
+// (Burley, "Practical Hash-based Owen Scrambling")
+inline uint32_t OwenScramble(uint32_t v, uint32_t seed)
+{
+    v = ReverseBits(v);
+    v += seed;
+    v ^= v * 0x6c50b47cu;
+    v ^= v * 0xb82f1e52u;
+    v ^= v * 0xc7afe638u;
+    v ^= v * 0x8d22f6e6u;
+    return ReverseBits(v);
+}
+
+// first two dimensions of the Sobol sequence as 32-bit fractions; the second
+// has direction numbers v_k = v_{k-1} ^ (v_{k-1} >> 1)
+inline void Sobol2D(uint32_t index, uint32_t &x, uint32_t &y)
+{
+    x = ReverseBits(index);
+    y = 0;
+    for (uint32_t v = 1u << 31; index; index >>= 1, v ^= v >> 1)
+        if (index & 1)
+            y ^= v;
+}
+
+// The sequence of every sampler below is one set of points per dimension,
+// decorrelated between dimensions by hashing the dimension into the
+// randomisation ("padding"), which keeps them usable for any path length.
+class IndependentSampler : public Sampler
+{
+public:
+    explicit IndependentSampler(uint32_t spp) : Sampler(SamplerType::Independent, spp) {}
+
+    // each sample gets 65536 numbers before overlapping the next one
+    void StartPixelSample(uint32_t pixelIndex, uint32_t sampleIndex, uint32_t seed) override
+    {
+        rng.SetSequence(MixBits(((uint64_t)seed << 32) | pixelIndex));
+        rng.Advance((int64_t)sampleIndex * 65536);
+    }
+    float Get1D() override { return rng.UniformFloat(); }
+    Vector2f Get2D() override
+    {
+        float u = rng.UniformFloat();
+        return Vector2f(u, rng.UniformFloat());
+    }
+
+private:
+    RNG rng;
+};
+
+// state shared by the low-discrepancy samplers: which point of the sequence
+// this sample is, and a per pixel seed the dimensions are hashed with
+class PaddedSampler : public Sampler
+{
+public:
+    using Sampler::Sampler;
+
+    void StartPixelSample(uint32_t pixelIndex, uint32_t sampleIndex, uint32_t seed) override
+    {
+        pixelSeed = MixBits(((uint64_t)seed << 32) | pixelIndex);
+        index = sampleIndex;
+        dimension = 0;
+        // jitter inside strata, from the same streams the independent sampler uses
+        rng.SetSequence(pixelSeed);
+        rng.Advance((int64_t)sampleIndex * 65536);
+    }
+
+protected:
+    // seed of the next dimension
+    uint64_t nextDimension() { return Hash(pixelSeed, dimension++); }
+    // stratified and Hammersley place spp points per set; later sample
+    // indices fall into further sets randomised by their set number
+    uint32_t setIndex() const { return index % spp; }
+    uint64_t setSeed(uint64_t dimensionSeed) const { return Hash(dimensionSeed, index / spp); }
+
+    uint64_t pixelSeed = 0;
+    uint32_t index = 0;
+    uint32_t dimension = 0;
+    RNG rng;
+};
+
+// jittered strata: spp in 1D, an nx * ny grid with nx * ny = spp in 2D
+class StratifiedSampler : public PaddedSampler
+{
+public:
+    explicit StratifiedSampler(uint32_t spp) : PaddedSampler(SamplerType::Stratified, spp)
+    {
+        nx = 1;
+        for (uint32_t d = 1; d * d <= spp; ++d)
+            if (spp % d == 0)
+                nx = d;
+    }
+
+    float Get1D() override
+    {
+        uint32_t stratum = PermutationElement(setIndex(), spp, (uint32_t)setSeed(nextDimension()));
+        return std::min(0x1.fffffep-1f, (stratum + rng.UniformFloat()) / spp);
+    }
+    Vector2f Get2D() override
+    {
+        uint32_t cell = PermutationElement(setIndex(), spp, (uint32_t)setSeed(nextDimension()));
+        uint32_t ny = spp / nx;
+        float u = std::min(0x1.fffffep-1f, (cell % nx + rng.UniformFloat()) / nx);
+        return Vector2f(u, std::min(0x1.fffffep-1f, (cell / nx + rng.UniformFloat()) / ny));
+    }
+
+private:
+    uint32_t nx;
+};
+
+// (i / spp, radical inverse of i) with the points shuffled per dimension
+// and randomised by a toroidal shift
+class HammersleySampler : public PaddedSampler
+{
+public:
+    explicit HammersleySampler(uint32_t spp) : PaddedSampler(SamplerType::Hammersley, spp) {}
+
+    float Get1D() override
+    {
+        uint64_t seed = setSeed(nextDimension());
+        uint32_t i = PermutationElement(setIndex(), spp, (uint32_t)seed);
+        return shift((i + 0.5f) / spp, seed >> 32);
+    }
+    Vector2f Get2D() override
+    {
+        uint64_t seed = setSeed(nextDimension());
+        uint32_t i = PermutationElement(setIndex(), spp, (uint32_t)seed);
+        uint64_t offsets = MixBits(seed);
+        return Vector2f(shift((i + 0.5f) / spp, (uint32_t)offsets),
+                        shift(ToUnitFloat(ReverseBits(i)), offsets >> 32));
+    }
+
+private:
+    static float shift(float u, uint32_t offset)
+    {
+        u += ToUnitFloat(offset);
+        return std::min(0x1.fffffep-1f, u >= 1 ? u - 1 : u);
+    }
+};
+
+// Owen-scrambled Sobol points with the index shuffled per dimension; unlike
+// the two above it needs no sample count and any prefix is well distributed
+class SobolSampler : public PaddedSampler
+{
+public:
+    explicit SobolSampler(uint32_t spp) : PaddedSampler(SamplerType::Sobol, spp) {}
+
+    float Get1D() override
+    {
+        uint64_t seed = nextDimension();
+        uint32_t i = OwenScramble(index, (uint32_t)seed);
+        return ToUnitFloat(OwenScramble(ReverseBits(i), seed >> 32));
+    }
+    Vector2f Get2D() override
+    {
+        uint64_t seed = nextDimension();
+        uint32_t i = OwenScramble(index, (uint32_t)seed);
+        uint32_t x, y;
+        Sobol2D(i, x, y);
+        uint64_t scramble = MixBits(seed);
+        return Vector2f(ToUnitFloat(OwenScramble(x, (uint32_t)scramble)),
+                        ToUnitFloat(OwenScramble(y, scramble >> 32)));
+    }
+};
+
+} // namespace
+
+std::unique_ptr<Sampler> Sampler::Create(SamplerType type, uint32_t samplesPerPixel)
+{
+    samplesPerPixel = std::max(1u, samplesPerPixel);
+    switch (type) {
+    case SamplerType::Stratified: return std::make_unique<StratifiedSampler>(samplesPerPixel);
+    case SamplerType::Hammersley: return std::make_unique<HammersleySampler>(samplesPerPixel);
+    case SamplerType::Sobol: return std::make_unique<SobolSampler>(samplesPerPixel);
+    default: return std::make_unique<IndependentSampler>(samplesPerPixel);
+    }
+}
+
+static thread_local std::unique_ptr<Sampler> threadSampler;
+
+Sampler& ThreadSampler()
+{
+    if (!threadSampler)
+        threadSampler = Sampler::Create(SamplerType::Independent, 1);
+    return *threadSampler;
+}
+
+void StartPixelSample(uint32_t pixelIndex, uint32_t sampleIndex, uint32_t seed)
+{
+    if (!threadSampler || threadSampler->type != Sampler::defaultType ||
+        threadSampler->spp != std::max(1u, Sampler::samplesPerPixel))
+        threadSampler = Sampler::Create(Sampler::defaultType, Sampler::samplesPerPixel);
+    threadSampler->StartPixelSample(pixelIndex, sampleIndex, seed);
+}
@@ -3,11 +3,85 @@
 //
 
 #include "Scene.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <iostream>
+#include <thread>
+
+// run fn on every object from a pool of threads, returns the pool size
+template <typename Fn>
+static int forEachObjectParallel(const std::vector<Object*> &objects, const Fn &fn)
+{
+    std::atomic<int> nextObject(0);
+    auto worker = [&]() {
+        for (int i = nextObject++; i < (int)objects.size(); i = nextObject++)
+            fn(objects[i]);
+    };
+    int numWorkers = std::min<int>(objects.size(), std::max(1u, std::thread::hardware_concurrency()));
+    std::vector<std::thread> workers;
+    for (int t = 1; t < numWorkers; ++t)
+        workers.emplace_back(worker);
+    worker();
+    for (auto &t : workers)
+        t.join();
+    return std::max(1, numWorkers);
+}
 
 void Scene::buildBVH() {
     printf(" - Generating BVH...\n\n");
-    this->bvh = new BVHAccel(objects, 1, BVHAccel::SplitMethod::NAIVE);
+    auto start = std::chrono::steady_clock::now();
+
+    // per-object BVHs are independent, hand them out to a pool of builders
+    int numBuilders = forEachObjectParallel(objects, [](Object* object) { object->buildBVH(); });
+    this->bvh = new BVHAccel(objects, 1, BVHAccel::defaultSplitMethod);
+    this->bvh->ReportCost("scene");
+    auto stop = std::chrono::steady_clock::now();
+    printf(" - BVH build: %.2f ms total on %d threads\n",
+           std::chrono::duration<double, std::milli>(stop - start).count(), numBuilders);
+
+    buildEmitterTable();
+    printf(" - %d emissive primitives, area %.2f\n", (int)emitters.size(), emitAreaSum);
+}
+
+void Scene::refitBVH() {
+    auto start = std::chrono::steady_clock::now();
+    // objects shared by instances are not in the scene list, refit each of
+    // them once before the instances pick up their new bounds
+    std::vector<Object*> shared;
+    for (Object* object : objects)
+        object->collectShared(shared);
+    std::sort(shared.begin(), shared.end());
+    shared.erase(std::unique(shared.begin(), shared.end()), shared.end());
+    shared.erase(std::remove_if(shared.begin(), shared.end(), [this](Object* object) {
+        return std::find(objects.begin(), objects.end(), object) != objects.end();
+    }), shared.end());
+    forEachObjectParallel(shared, [](Object* object) { object->refitBVH(); });
+    forEachObjectParallel(objects, [](Object* object) { object->refitBVH(); });
+    this->bvh->Refit();
+    float quality = this->bvh->RefitQuality();
+    bool rebuild = this->bvh->NeedsRebuild();
+    if (rebuild) {
+        delete this->bvh;
+        this->bvh = new BVHAccel(objects, 1, BVHAccel::defaultSplitMethod);
+    }
+    buildEmitterTable();
+    auto stop = std::chrono::steady_clock::now();
+    printf(" - BVH refit: %.2f ms, scene SAH cost x%.2f of a fresh build%s\n",
+           std::chrono::duration<double, std::milli>(stop - start).count(), quality,
+           rebuild ? ", rebuilt" : "");
+}
+
+void Scene::buildEmitterTable() {
+    emitters.clear();
+    emitterCdf.clear();
+    emitAreaSum = 0;
+    for (Object* object : objects)
+        object->collectEmitters(emitters);
+    for (Object* emitter : emitters) {
+        emitAreaSum += emitter->getArea();
+        emitterCdf.push_back(emitAreaSum);
+    }
 }
 
 Intersection Scene::intersect(const Ray &ray) const
@@ -15,25 +89,42 @@ Intersection Scene::intersect(const Ray &ray) const
     return this->bvh->Intersect(ray);
 }
 
+bool Scene::intersectP(const Ray &ray) const
+{
+    return this->bvh->IntersectP(ray);
+}
+
 void Scene::sampleLight(Intersection &pos, float &pdf) const
 {
-    float emit_area_sum = 0;
-    for (uint32_t k = 0; k < objects.size(); ++k) {
-        if (objects[k]->hasEmit()){
-            emit_area_sum += objects[k]->getArea();
-        }
-    }
-    float p = get_random_float() * emit_area_sum;
-    emit_area_sum = 0;
-    for (uint32_t k = 0; k < objects.size(); ++k) {
-        if (objects[k]->hasEmit()){
-            emit_area_sum += objects[k]->getArea();
-            if (p <= emit_area_sum){
-                objects[k]->Sample(pos, pdf);
-                break;
-            }
-        }
+    if (emitters.empty()) {
+        pdf = 0.0f;
+        return;
     }
+    float p = get_random_float() * emitAreaSum;
+    int k = std::upper_bound(emitterCdf.begin(), emitterCdf.end(), p) - emitterCdf.begin();
+    k = std::min(k, (int)emitters.size() - 1);
+    // area pdf on the chosen primitive times the chance of choosing it
+    emitters[k]->Sample(pos, pdf);
+    pdf *= emitters[k]->getArea() / emitAreaSum;
+}
+
+float Scene::lightPdf(const Intersection &lightHit, const Vector3f &from) const
+{
+    if (emitAreaSum <= 0)
+        return 0.0f;
+    Vector3f toLight = lightHit.coords - from;
+    float dist2 = dotProduct(toLight, toLight);
+    float cosLight = dotProduct(lightHit.normal, -toLight.normalized());
+    if (cosLight <= 0.0f)
+        return 0.0f;
+    float pdfArea = lightHit.obj->samplePdf(lightHit) * lightHit.obj->getArea() / emitAreaSum;
+    return pdfArea * dist2 / cosLight;
+}
+
+// weight of a sample drawn with density f against another strategy of density g
+static float PowerHeuristic(float f, float g)
+{
+    return f * f / (f * f + g * g);
 }
 
 bool Scene::trace(
@@ -58,53 +149,106 @@ bool Scene::trace(
 }
 
 // Implementation of Path Tracing
+// The path is followed in a loop: throughput holds the product of
+// BSDF weights / pdfs so far, radiance what has already reached the eye.
+// Emitters are reached both by light sampling and by BSDF sampling, each
+// contribution is weighted against the other strategy's density with the
+// power heuristic.
 Vector3f Scene::castRay(const Ray &ray, int depth) const
 {
-    // TO DO Implement Path Tracing Algorithm here
-    // 求着色点
-    Intersection hit = intersect(ray);
-    if (!hit.happened) return depth == 0 ? backgroundColor : Vector3f(0.f);
-    if (hit.obj->hasEmit()) return hit.emit;
-    Vector3f res_dir = Vector3f(0.0);
-    Material* shadingPMaterial = hit.m;
-    Vector3f w_out = -(ray.direction);
-    Vector3f shadingPNormal = hit.normal;
-    float dist_to_eye = hit.distance;
+    return tracePath(ray, depth, nullptr);
+}
 
-    // 判断有没有直接光照
-    Intersection posL = Intersection();
-    float pdf = 0.0f;
-    sampleLight(posL, pdf);
-    Vector3f light_dir = (posL.coords - hit.coords).normalized();
-    Ray lightRay = Ray(hit.coords, light_dir);
-    float dist = (posL.coords - hit.coords).norm();
-    Intersection obj_occlusion = intersect(lightRay);
-    // 如果光源和着色点相交，就采样直接光照
-    if (dist - obj_occlusion.distance < 0.001f && pdf > 0.0f && shadingPMaterial->m_type != MIRROR) {
-        Vector3f fr = shadingPMaterial->eval(light_dir, w_out, shadingPNormal, true);
-        float nl = std::max(0.0f, dotProduct(shadingPNormal, light_dir));
+Vector3f Scene::castRay(const Ray &ray, const Intersection &primaryHit) const
+{
+    return tracePath(ray, 0, &primaryHit);
+}
 
-        Vector3f light_normal = posL.normal;
-        float nll = std::max(0.0f, dotProduct(light_normal, -light_dir));
+// firstHit, if given, replaces the intersection of ray itself
+Vector3f Scene::tracePath(const Ray &ray, int depth, const Intersection *firstHit) const
+{
+    Vector3f radiance(0.f);
+    Vector3f throughput(1.f);
+    Ray pathRay = ray;
+    // where the path ray left from and the BSDF density it was drawn with,
+    // zero when no light sample could have found the same emitter point
+    Vector3f pathOrigin;
+    float bsdfPdf = 0.0f;
+    for (; depth < maxDepth; ++depth) {
+        // 求着色点
+        Intersection hit = firstHit ? *firstHit : intersect(pathRay);
+        firstHit = nullptr;
+        if (!hit.happened) {
+            if (depth == 0) radiance += throughput * backgroundColor;
+            break;
+        }
+        if (hit.obj->hasEmit()) {
+            float weight = 1.0f;
+            if (bsdfPdf > 0.0f)
+                weight = PowerHeuristic(bsdfPdf, lightPdf(hit, pathOrigin));
+            radiance += throughput * hit.emit * weight;
+            break;
+        }
+        Material* shadingPMaterial = hit.m;
+        Vector3f w_out = -(pathRay.direction);
+        Vector3f shadingPNormal = hit.normal;
 
-        Vector3f lightEmit = posL.emit * nl * nll * fr / (pdf * dist * dist);
-        res_dir += lightEmit;
-    }
-    // 采样间接光照
-    Vector3f res_ind = Vector3f(0.f);
-    float Prr = get_random_float();
-    if (Prr < RussianRoulette) {
+        // 判断有没有直接光照, a delta lobe reflects no sampled light
+        if (!shadingPMaterial->isDelta()) {
+            Intersection posL = Intersection();
+            float pdf = 0.0f;
+            sampleLight(posL, pdf);
+            Vector3f light_dir = (posL.coords - hit.coords).normalized();
+            Ray lightRay = Ray(hit.coords, light_dir);
+            float dist = (posL.coords - hit.coords).norm();
+            lightRay.t_max = dist - 0.001f;
+            Vector3f light_normal = posL.normal;
+            float nll = std::max(0.0f, dotProduct(light_normal, -light_dir));
+            // 如果光源和着色点相交，就采样直接光照
+            if (pdf > 0.0f && nll > 0.0f && !intersectP(lightRay)) {
+                // eval already carries the cosine at the shading point
+                Vector3f fr = shadingPMaterial->eval(light_dir, w_out, shadingPNormal);
+                float pdfLight = pdf * dist * dist / nll;
+                float weight = PowerHeuristic(pdfLight, shadingPMaterial->pdf(light_dir, w_out, shadingPNormal));
+                radiance += throughput * posL.emit * fr * weight / pdfLight;
+            }
+        }
+
+        // 采样间接光照, dim paths are dropped by Russian roulette on their throughput
+        float survive = 1.f;
+        if (depth >= russianRouletteDepth) {
+            float maxThroughput = std::max(throughput.x, std::max(throughput.y, throughput.z));
+            survive = std::min(RussianRoulette, maxThroughput);
+            if (get_random_float() >= survive)
+                break;
+        }
         Vector3f wl = shadingPMaterial->sample(w_out, shadingPNormal).normalized();
         float nl = dotProduct(shadingPNormal, wl);
-        if (nl > EPSILON) {
-            Vector3f ray_orig_ind = hit.coords + shadingPNormal * .01f;
-            Vector3f castLi = castRay(Ray(ray_orig_ind, wl), depth+1);
-            Vector3f weight_or_frdotnl = shadingPMaterial->eval(wl, w_out, shadingPNormal, false);
-            float pdf = shadingPMaterial->pdf(wl, w_out, shadingPNormal);
-            res_ind += castLi * weight_or_frdotnl / (pdf * RussianRoulette);
-        }
+        if (nl <= EPSILON)
+            break;
+        Vector3f frdotnl = shadingPMaterial->eval(wl, w_out, shadingPNormal);
+        float pdf_ind = shadingPMaterial->pdf(wl, w_out, shadingPNormal);
+        if (pdf_ind <= 0.0f)
+            break;
+        throughput = throughput * frdotnl / (pdf_ind * survive);
+        bsdfPdf = shadingPMaterial->isDelta() ? 0.0f : pdf_ind;
+        pathOrigin = hit.coords;
+        pathRay = Ray(hit.coords + shadingPNormal * .01f, wl);
+    }
+    return radiance;
+}
+
+PixelFeatures Scene::firstHitFeatures(const Intersection &primaryHit) const
+{
+    PixelFeatures features;
+    if (!primaryHit.happened) {
+        features.albedo = backgroundColor;
+        return features;
     }
-    return Vector3f::Min(Vector3f(1), Vector3f::Max(Vector3f(0), (res_dir+res_ind)));
+    features.albedo = primaryHit.m->Kd;
+    features.normal = primaryHit.normal;
+    features.depth = primaryHit.distance;
+    return features;
 }
 
 Vector3f Scene::castRayDiff(const Ray &ray, int depth) const
@@ -128,9 +272,9 @@ Vector3f Scene::castRayDiff(const Ray &ray, int depth) const
     Vector3f light_dir = (posL.coords - hit.coords).normalized();
     Ray lightRay = Ray(hit.coords, light_dir);
     float dist = (posL.coords - hit.coords).norm();
-    Intersection obj_occlusion = intersect(lightRay);
+    lightRay.t_max = dist - 0.001f;
     // 如果光源和着色点相交，就采样直接光照
-    if (dist - obj_occlusion.distance < 0.001f && pdf > 0.0f) {
+    if (!intersectP(lightRay) && pdf > 0.0f) {
         Vector3f fr = diff_kd / M_PI;
         float nl = std::max(0.0f, dotProduct(shadingPNormal, light_dir));
 
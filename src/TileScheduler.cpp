@@ -0,0 +1,50 @@
+#include <algorithm>
+#include "TileScheduler.hpp"
+
+TileScheduler::TileScheduler(int width, int height, int tileSize, int numWorkers)
+    : numWorkers(std::max(1, numWorkers)), numTiles(0),
+      queues(new WorkerQueue[std::max(1, numWorkers)])
+{
+    tileSize = std::max(1, tileSize);
+    // deal tiles round-robin so every worker starts spread over the image
+    for (int y = 0; y < height; y += tileSize) {
+        for (int x = 0; x < width; x += tileSize) {
+            Tile tile{x, y, std::min(x + tileSize, width), std::min(y + tileSize, height)};
+            queues[numTiles % this->numWorkers].tiles.push_back(tile);
+            numTiles++;
+        }
+    }
+}
+
+bool TileScheduler::popFront(WorkerQueue &queue, Tile &tile)
+{
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (queue.tiles.empty())
+        return false;
+    tile = queue.tiles.front();
+    queue.tiles.pop_front();
+    return true;
+}
+
+bool TileScheduler::popBack(WorkerQueue &queue, Tile &tile)
+{
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (queue.tiles.empty())
+        return false;
+    tile = queue.tiles.back();
+    queue.tiles.pop_back();
+    return true;
+}
+
+bool TileScheduler::next(int worker, Tile &tile)
+{
+    if (popFront(queues[worker], tile))
+        return true;
+    // tiles are never added after construction, so one sweep over the
+    // victims is enough to know the image is done
+    for (int i = 1; i < numWorkers; ++i) {
+        if (popBack(queues[(worker + i) % numWorkers], tile))
+            return true;
+    }
+    return false;
+}
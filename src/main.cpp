@@ -1,3 +1,4 @@
+#include "Instance.hpp"
 #include "Renderer.hpp"
 #include "Scene.hpp"
 #include "Triangle.hpp"
@@ -5,6 +6,58 @@
 #include "Vector.hpp"
 #include "global.hpp"
 #include <chrono>
+#include <string>
+
+// --refit-check: deform the given meshes and move an instance, refit the
+// scene, then rebuild every BVH from scratch and compare the hits of random
+// rays between the two; returns the number of rays that disagree
+static int CheckRefit(Scene& scene, const std::vector<MeshTriangle*>& meshes, Instance* instance)
+{
+    // stretch each mesh along x, squash it along y and shear it in z
+    for (MeshTriangle* mesh : meshes) {
+        Vector3f c = mesh->getBounds().Centroid();
+        for (uint32_t i = 0; i < mesh->numVertices; ++i) {
+            Vector3f p = mesh->vertices[i];
+            mesh->setVertex(i, Vector3f(c.x + 1.1f * (p.x - c.x), c.y + .8f * (p.y - c.y), p.z + .1f * (p.x - c.x)));
+        }
+    }
+    if (instance)
+        instance->setTransform(Transform::Translate(Vector3f(0, 40.f, 0)) * instance->transform());
+    scene.refitBVH();
+
+    const int numRays = 100000;
+    Bounds3 world = scene.bvh->WorldBound();
+    RNG rng;
+    std::vector<Ray> rays;
+    std::vector<Intersection> refit(numRays);
+    std::vector<bool> refitOccluded(numRays);
+    for (int i = 0; i < numRays; ++i) {
+        Vector3f o = world.pMin + Vector3f(rng.UniformFloat(), rng.UniformFloat(), rng.UniformFloat()) * world.Diagonal();
+        float z = 1 - 2 * rng.UniformFloat(), r = std::sqrt(std::max(0.f, 1 - z * z)), phi = 2 * M_PI * rng.UniformFloat();
+        rays.emplace_back(o, Vector3f(r * std::cos(phi), r * std::sin(phi), z));
+        rays.back().t_max = 300.f;
+        refit[i] = scene.intersect(rays[i]);
+        refitOccluded[i] = scene.intersectP(rays[i]);
+    }
+
+    for (MeshTriangle* mesh : meshes) {
+        delete mesh->bvh;
+        mesh->bvh = mesh->newBVH();
+    }
+    delete scene.bvh;
+    scene.bvh = new BVHAccel(scene.objects, 1, BVHAccel::defaultSplitMethod);
+
+    int mismatches = 0, hits = 0;
+    for (int i = 0; i < numRays; ++i) {
+        Intersection fresh = scene.intersect(rays[i]);
+        hits += fresh.happened;
+        if (fresh.happened != refit[i].happened || scene.intersectP(rays[i]) != refitOccluded[i] ||
+            (fresh.happened && std::fabs(fresh.distance - refit[i].distance) > 1e-3f * std::max(1.f, fresh.distance)))
+            ++mismatches;
+    }
+    printf(" - refit check: %d rays, %d hits, %d differ from a fresh build\n", numRays, hits, mismatches);
+    return mismatches;
+}
 
 // In the main function of the program, we create the scene (create objects and
 // lights) as well as set the options for the render (image width and height,
@@ -14,6 +67,51 @@ int main(int argc, char** argv)
 {
     // Change the definition here to change resolution
     Scene scene(784, 784);
+    // usage: RayTraycing [spp] [--threads N] [--tile N] [--max-depth N] [--bvh4]
+    //                   [--bvh-build naive|sah|hlbvh|sbvh]
+    //                   [--split-budget F] [--instances N] [--no-cache] [--bvh-stats]
+    //                   [--adaptive ERR] [--min-spp N]
+    //                   [--checkpoint FILE] [--checkpoint-interval SECONDS] [--resume] [--seed N]
+    //                   [--sampler independent|stratified|hammersley|sobol]
+    //                   [--aov] [--denoise] [--refit-check]
+    RenderOptions options;
+    int numInstances = 0;
+    bool refitCheck = false;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--threads" && i + 1 < argc) options.numThreads = atoi(argv[++i]);
+        else if (arg == "--max-depth" && i + 1 < argc) scene.maxDepth = atoi(argv[++i]);
+        else if (arg == "--tile" && i + 1 < argc) options.tileSize = atoi(argv[++i]);
+        else if (arg == "--adaptive" && i + 1 < argc) options.adaptiveError = atof(argv[++i]);
+        else if (arg == "--min-spp" && i + 1 < argc) options.minSpp = atoi(argv[++i]);
+        else if (arg == "--checkpoint" && i + 1 < argc) options.checkpointPath = argv[++i];
+        else if (arg == "--checkpoint-interval" && i + 1 < argc) options.checkpointInterval = atof(argv[++i]);
+        else if (arg == "--resume") options.resume = true;
+        else if (arg == "--seed" && i + 1 < argc) options.seed = strtoul(argv[++i], nullptr, 10);
+        else if (arg == "--aov") options.writeAovs = true;
+        else if (arg == "--denoise") options.denoise = true;
+        else if (arg == "--refit-check") refitCheck = true;
+        else if (arg == "--bvh-stats") BVHAccel::compareWithMedian = true;
+        else if (arg == "--no-cache") MeshTriangle::useCache = false;
+        else if (arg == "--split-budget" && i + 1 < argc) BVHAccel::spatialSplitBudget = atof(argv[++i]);
+        else if (arg == "--instances" && i + 1 < argc) numInstances = atoi(argv[++i]);
+        else if (arg == "--bvh4") BVHAccel::defaultAccelerator = BVHAccel::Accelerator::BVH4;
+        else if (arg == "--sampler" && i + 1 < argc) {
+            std::string sampler = argv[++i];
+            if (sampler == "stratified") Sampler::defaultType = SamplerType::Stratified;
+            else if (sampler == "hammersley") Sampler::defaultType = SamplerType::Hammersley;
+            else if (sampler == "sobol") Sampler::defaultType = SamplerType::Sobol;
+            else Sampler::defaultType = SamplerType::Independent;
+        }
+        else if (arg == "--bvh-build" && i + 1 < argc) {
+            std::string method = argv[++i];
+            if (method == "naive") BVHAccel::defaultSplitMethod = BVHAccel::SplitMethod::NAIVE;
+            else if (method == "hlbvh") BVHAccel::defaultSplitMethod = BVHAccel::SplitMethod::HLBVH;
+            else if (method == "sbvh") BVHAccel::defaultSplitMethod = BVHAccel::SplitMethod::SBVH;
+            else BVHAccel::defaultSplitMethod = BVHAccel::SplitMethod::SAH;
+        }
+        else if (atoi(argv[i]) > 0) options.spp = atoi(argv[i]);
+    }
     float roughness_all = .33f;
     float metallic_all = .5f;
     Material* red = new Material(MICRO_FACET, Vector3f(0.0f));
@@ -56,12 +154,36 @@ int main(int argc, char** argv)
     scene.Add(&light_);
     scene.Add(&smooth_sph);
 
+    // scatter copies of one bunny over the floor, all sharing its BVH
+    std::unique_ptr<MeshTriangle> bunny;
+    std::vector<std::unique_ptr<Instance>> instances;
+    if (numInstances > 0) {
+        bunny = std::make_unique<MeshTriangle>("./models/bunny/bunny.obj", white);
+        Material* palette[] = {white, red, green};
+        RNG rng;
+        rng.SetSequence(numInstances);
+        for (int i = 0; i < numInstances; ++i) {
+            float x = 40.f + 476.f * rng.UniformFloat(), z = 40.f + 476.f * rng.UniformFloat();
+            float angle = 2 * M_PI * rng.UniformFloat();
+            Transform toWorld = Transform::Translate(Vector3f(x, -8.3f, z)) *
+                                Transform::Rotate(angle, Vector3f(0, 1, 0)) *
+                                Transform::Scale(Vector3f(250.f));
+            instances.push_back(std::make_unique<Instance>(bunny.get(), toWorld, palette[i % 3]));
+            scene.Add(instances.back().get());
+        }
+    }
+
     scene.buildBVH();
+    if (refitCheck) {
+        std::vector<MeshTriangle*> deformed = {&tallbox};
+        if (bunny)
+            deformed.push_back(bunny.get());
+        return CheckRefit(scene, deformed, instances.empty() ? nullptr : instances[0].get()) == 0 ? 0 : 1;
+    }
     Renderer r;
-    int cur_i = argc == 2 ? atoi(argv[1]) : 8;
-    int spp = argc > 1 ? (cur_i > 0 ? cur_i : 8) : 8;
     auto start = std::chrono::system_clock::now();
-    r.RenderMultiThread(scene, spp);
+    if (!r.RenderMultiThread(scene, options))
+        return 1;
     auto stop = std::chrono::system_clock::now();
 
     auto render_hours = std::chrono::duration_cast<std::chrono::hours>(stop - start).count();